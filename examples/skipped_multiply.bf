@@ -0,0 +1,6 @@
+The first loop moves cell 0 into the cell left of it but never runs
+because cell 0 starts at zero so the program must not stop for moving
+left of the tape and prints the digit 0
+
+[-<+>]
+++++++++[>++++++<-]>.
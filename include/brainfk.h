@@ -0,0 +1,209 @@
+#ifndef BRAINFK_H
+#define BRAINFK_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+namespace brainfk {
+
+/**
+ * What ',' stores in the current cell once the input is exhausted.
+ */
+enum class EofPolicy {
+    Unchanged,
+    Zero,
+    MinusOne,
+};
+
+/**
+ * How the optimized program is run. The JIT falls back to the threaded
+ * interpreter when the host refuses executable memory. C translates the
+ * program to C and builds it with the system compiler, which takes long
+ * but makes the fastest code for long-running programs; it falls back to
+ * the JIT when there is no compiler. Tiered starts interpreting at once
+ * and only compiles the loops that turn out to be hot, which suits short
+ * programs.
+ */
+enum class Backend {
+    Jit,
+    Threaded,
+    C,
+    Tiered,
+};
+
+struct Options {
+    EofPolicy eof{EofPolicy::Unchanged};
+    Backend backend{Backend::Jit};
+    // Size of a tape cell in bits: 8, 16, 32 or 64
+    int cell_bits{8};
+    // Directory where JIT output is cached across processes; no caching
+    // when empty
+    std::string cache_directory;
+};
+
+/**
+ * Where a program's output goes and its input comes from. Both callbacks
+ * get context as their first argument. write must take all size bytes and
+ * returns false on error; read stores up to capacity bytes in buffer and
+ * returns how many, 0 meaning end of input.
+ */
+struct Io {
+    bool (*write)(void *context, const char *data, size_t size);
+    size_t (*read)(void *context, char *buffer, size_t capacity);
+    void *context;
+
+    /**
+     * Standard output and standard input of the process
+     */
+    static Io standard();
+};
+
+/**
+ * How a run ended. Moving off the tape stops the program; the output it
+ * produced up to that point has been written. The tapes of all contexts
+ * share half of the physical memory, and running out of it also counts as
+ * moving past the tape. NoTape means the context has no tape to run on and
+ * the program did not start.
+ */
+enum class Status {
+    Ok,
+    MovedLeftOfTape,
+    MovedPastTape,
+    NoTape,
+};
+
+const char *describe(Status status);
+
+/**
+ * The tape and I/O buffers programs run against. A context can be reused
+ * for any number of runs, each starting from a zeroed tape, but only runs
+ * one program at a time. Use one context per thread.
+ */
+struct Context {
+    explicit Context(Io io = Io::standard());
+    Context(Context &&other);
+    Context &operator=(Context &&other);
+    ~Context();
+
+    /**
+     * False if no memory could be reserved for the tape
+     */
+    bool valid() const;
+    void set_io(Io io);
+
+  private:
+    friend struct CompiledProgram;
+    struct State;
+    std::unique_ptr<State> state;
+};
+
+/**
+ * A program compiled once and run any number of times. Running does not
+ * modify it, so several threads can run the same program, each with its
+ * own Context.
+ */
+struct CompiledProgram {
+    /**
+     * Parses, optimizes and compiles source. If the source is invalid the
+     * result is not valid() and error() says why.
+     */
+    static CompiledProgram compile(const char *source, size_t length,
+                                   const Options &options = Options());
+    CompiledProgram(CompiledProgram &&other);
+    CompiledProgram &operator=(CompiledProgram &&other);
+    ~CompiledProgram();
+
+    bool valid() const;
+    const std::string &error() const;
+    /**
+     * Bytes of generated code, or of threaded code for the interpreter
+     */
+    size_t code_size() const;
+    /**
+     * Runs the program on a freshly zeroed tape of context
+     */
+    Status run(Context &context) const;
+
+  private:
+    CompiledProgram();
+
+    struct State;
+    std::unique_ptr<State> state;
+};
+
+/**
+ * Compiles source ahead of time into a standalone static x86-64 Linux
+ * executable at path, which runs the program on its stdin and stdout.
+ * Returns false and sets error if the source is invalid or the file could
+ * not be written.
+ */
+bool compile_executable(const char *source, size_t length,
+                        const Options &options, const std::string &path,
+                        std::string &error);
+
+/**
+ * Compiles source ahead of time into an x86-64 ELF relocatable object at
+ * path that defines
+ *
+ *     extern "C" int bf_<name>(char *tape);
+ *
+ * and expects whoever links it to define the I/O functions
+ *
+ *     extern "C" void bf_write(const char *data, size_t size);
+ *     extern "C" size_t bf_read(char *buffer, size_t capacity);
+ *
+ * where bf_read returns 0 at end of input. tape must point to zeroed cells
+ * and be aligned to 32 bytes, and the program may read the rest of any 32
+ * bytes it reaches; nothing checks that it stays on the tape. name must
+ * be made of letters, digits and underscores. Returns false and sets error
+ * if the source or name is invalid or the file could not be written.
+ */
+bool compile_object(const char *source, size_t length, const Options &options,
+                    const std::string &name, const std::string &path,
+                    std::string &error);
+
+/**
+ * Translates source to the C code the C backend builds and writes it to
+ * path without compiling it. The file defines
+ *
+ *     unsigned long long bf_run(char *tape, struct runtime *rt);
+ *
+ * and struct runtime, which holds the output and input buffers and the
+ * flush and fill hooks bf_run calls when they run full or empty. tape must
+ * point to zeroed cells, and nothing checks that the program stays on it.
+ * Returns false and sets error if the source is invalid or the file could
+ * not be written.
+ */
+bool compile_c_source(const char *source, size_t length,
+                      const Options &options, const std::string &path,
+                      std::string &error);
+
+/**
+ * Thread-safe cache of compiled programs for processes that see the same
+ * programs over and over. Programs are keyed by their commands, ignoring
+ * comments, and the options, and the least recently used ones are dropped
+ * once their code exceeds the capacity. Concurrent requests for a program that
+ * is being compiled wait for that compilation instead of repeating it.
+ */
+struct ProgramCache {
+    explicit ProgramCache(size_t capacity_bytes);
+    ~ProgramCache();
+
+    /**
+     * Returns the compiled program, compiling it on a miss. Invalid
+     * programs are returned but not cached. Evicted programs stay alive
+     * as long as someone holds them. If compiling throws, the exception
+     * reaches every request waiting for that compilation.
+     */
+    std::shared_ptr<const CompiledProgram>
+    get(const char *source, size_t length, const Options &options = Options());
+
+  private:
+    struct State;
+    std::unique_ptr<State> state;
+};
+
+} // namespace brainfk
+
+#endif
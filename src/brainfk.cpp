@@ -0,0 +1,4001 @@
+#include "brainfk.h"
+
+#include <cctype>
+#include <cerrno>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <dlfcn.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <immintrin.h>
+#include <future>
+#include <iostream>
+#include <link.h>
+#include <list>
+#include <mutex>
+#include <setjmp.h>
+#include <signal.h>
+#include <spawn.h>
+#include <memory>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace brainfk {
+
+/**
+ * State shared between the generated code and the host. The generated code
+ * keeps a pointer to it in RBP, appends output bytes inline and only calls
+ * back into the host through the hooks when a buffer needs servicing.
+ */
+struct Runtime {
+    char *out_cursor;
+    char *out_end;
+    char *out_buffer;
+    int (*flush)(Runtime *);
+    char *in_cursor;
+    char *in_end;
+    char *in_buffer;
+    int (*fill)(Runtime *);
+    // Only used by the hooks
+    Io io;
+};
+
+typedef unsigned long long (*FnPointer)(char *, Runtime *);
+
+/**
+ * One IR instruction. Instructions are 8-byte values stored back to back in
+ * Program::instructions; loops are delimited by Loop/EndLoop.
+ */
+struct Instruction {
+    enum class Type : unsigned char {
+        Add,
+        Sub,
+        Right,
+        Left,
+        Loop,
+        EndLoop,
+        Write,
+        Read,
+        Set,
+        MulAdd,
+        Scan,
+    };
+    static const int max_offset = (1 << 23) - 1;
+    // Longest Right/Left the parser emits. Longer runs are split and the
+    // cell at each split is touched, so a program never gets more than
+    // max_reach cells away from the last cell it accessed: one move plus
+    // the farthest MulAdd target. Guards of that size around the tape
+    // catch every move off it.
+    static const int max_move = max_offset;
+    static const int max_reach = max_move + (1 << 15);
+
+    Type type;
+    // Cell the instruction works on, relative to the tape pointer after the
+    // last pointer move or loop boundary
+    int offset : 24;
+    union {
+        // Amount for Add/Sub/Right/Left/Set, stride for Scan
+        int value;
+        // MulAdd: cell[offset + distance] += factor * cell[offset]
+        struct {
+            short distance;
+            short factor;
+        } mul;
+    };
+
+    static Instruction add(int value) { return make(Type::Add, value); }
+    static Instruction sub(int value) { return make(Type::Sub, value); }
+    static Instruction right(int value) { return make(Type::Right, value); }
+    static Instruction left(int value) { return make(Type::Left, value); }
+    static Instruction loop() { return make(Type::Loop, 0); }
+    static Instruction end_loop() { return make(Type::EndLoop, 0); }
+    static Instruction write() { return make(Type::Write, 0); }
+    static Instruction read() { return make(Type::Read, 0); }
+    static Instruction set(int value) { return make(Type::Set, value); }
+    /**
+     * Moves by stride until the current cell is zero, i.e. `[>]` or `[<<]`.
+     */
+    static Instruction scan(int stride) { return make(Type::Scan, stride); }
+    static Instruction mul_add(int distance, int factor) {
+        Instruction insn = make(Type::MulAdd, 0);
+        insn.mul.distance = distance;
+        insn.mul.factor = factor;
+        return insn;
+    }
+
+    int target() const { return offset + mul.distance; }
+
+    void print() {
+        switch (type) {
+        case Type::Add:
+            std::cerr << "Add(" << value << ")";
+            break;
+        case Type::Sub:
+            std::cerr << "Sub(" << value << ")";
+            break;
+        case Type::Right:
+            std::cerr << "Right(" << value << ")";
+            break;
+        case Type::Left:
+            std::cerr << "Left(" << value << ")";
+            break;
+        case Type::Loop:
+            std::cerr << "Loop";
+            break;
+        case Type::EndLoop:
+            std::cerr << "EndLoop";
+            break;
+        case Type::Write:
+            std::cerr << "Write";
+            break;
+        case Type::Read:
+            std::cerr << "Read";
+            break;
+        case Type::Set:
+            std::cerr << "Set(" << value << ")";
+            break;
+        case Type::MulAdd:
+            std::cerr << "MulAdd(" << target() << ", " << mul.factor << ")";
+            break;
+        case Type::Scan:
+            std::cerr << "Scan(" << value << ")";
+            break;
+        }
+        if (offset != 0) {
+            std::cerr << " @ " << offset;
+        }
+        std::cerr << "\n";
+    }
+
+  private:
+    static Instruction make(Type type, int value) {
+        Instruction insn;
+        insn.type = type;
+        insn.offset = 0;
+        insn.value = value;
+        return insn;
+    }
+};
+
+static_assert(sizeof(Instruction) == 8, "Instructions should pack in 8 bytes");
+
+/**
+ * Bump allocator over a single reservation that is released in one shot.
+ * The reservation is made with MAP_NORESERVE, so it can be sized for the
+ * worst case while only the pages actually written are committed. If the
+ * reservation fails the arena is empty and every allocation returns null.
+ */
+struct Arena {
+    explicit Arena(size_t size) {
+        if (size == 0) {
+            return;
+        }
+        void *reserved = mmap(0, size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                              -1, 0);
+        if (reserved == MAP_FAILED) {
+            return;
+        }
+        memory = (char *)reserved;
+        capacity = size;
+    }
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+    Arena(Arena &&other) { *this = std::move(other); }
+    Arena &operator=(Arena &&other) {
+        std::swap(memory, other.memory);
+        std::swap(used, other.used);
+        std::swap(capacity, other.capacity);
+        return *this;
+    }
+    ~Arena() {
+        if (memory != nullptr) {
+            munmap(memory, capacity);
+        }
+    }
+
+    template <typename T> T *allocate(size_t count) {
+        size_t start = (used + alignof(T) - 1) & ~(alignof(T) - 1);
+        if (start + count * sizeof(T) > capacity) {
+            return nullptr;
+        }
+        used = start + count * sizeof(T);
+        return (T *)(memory + start);
+    }
+
+  private:
+    char *memory{nullptr};
+    size_t used{0};
+    size_t capacity{0};
+};
+
+/**
+ * Fixed-capacity array carved out of an Arena. Items pushed beyond the
+ * capacity, which is 0 if the arena could not provide it, are dropped and
+ * failed() reports it.
+ */
+template <typename T> struct ArenaArray {
+    ArenaArray(Arena &arena, size_t capacity)
+        : items(arena.allocate<T>(capacity)),
+          capacity(items != nullptr ? capacity : 0) {}
+
+    void push_back(T item) {
+        if (count == capacity) {
+            overflowed = true;
+            return;
+        }
+        items[count++] = item;
+    }
+    void pop_back() { count--; }
+    /**
+     * Shrinks the array to its first count items
+     */
+    void resize(size_t new_count) { count = new_count; }
+    T &back() { return items[count - 1]; }
+    T &operator[](size_t index) { return items[index]; }
+    bool empty() { return count == 0; }
+    size_t size() { return count; }
+    T *begin() { return items; }
+    T *end() { return items + count; }
+    bool failed() { return overflowed; }
+
+  private:
+    T *items;
+    size_t count{0};
+    size_t capacity;
+    bool overflowed{false};
+};
+
+/**
+ * A Program owns the arena its instructions live in. The capacity is an
+ * upper bound given by the producer: the parser emits at most one
+ * instruction per command and optimization never grows a program.
+ * failed() means memory ran out and instructions were lost.
+ */
+struct Program {
+    explicit Program(size_t capacity)
+        : arena(capacity * sizeof(Instruction)),
+          instructions(arena, capacity) {}
+
+    Arena arena;
+    ArenaArray<Instruction> instructions;
+    void append(Instruction insn) { instructions.push_back(insn); }
+    bool failed() { return instructions.failed(); }
+    void print() {
+        int depth = 0;
+        for (auto &insn : instructions) {
+            if (insn.type == Instruction::Type::EndLoop) {
+                depth--;
+            }
+            std::cerr << std::string(2 * depth, ' ');
+            insn.print();
+            if (insn.type == Instruction::Type::Loop) {
+                depth++;
+            }
+        }
+    }
+};
+
+namespace JIT {
+
+enum class Register8 {
+    AL = 0b000,
+    BL = 0b011,
+    CL = 0b001,
+    DL = 0b010,
+};
+
+enum class Register32 {
+    EAX = 0b000,
+    EBX = 0b011,
+    ECX = 0b001,
+    EDX = 0b010,
+    ESI = 0b110,
+    EDI = 0b111,
+};
+
+enum class Register64 {
+    RAX = 0b000,
+    RBX = 0b011,
+    RCX = 0b001,
+    RDX = 0b010,
+    RSP = 0b100,
+    RBP = 0b101,
+    RSI = 0b110,
+    RDI = 0b111,
+};
+
+enum class Register128 {
+    XMM0 = 0b000,
+    XMM1 = 0b001,
+};
+
+enum class Register256 {
+    YMM0 = 0b000,
+    YMM1 = 0b001,
+};
+
+/**
+ * Size of a memory operand in bytes. Instructions that touch cells take the
+ * width of the tape's cells.
+ */
+enum class Width {
+    Byte = 1,
+    Word = 2,
+    Dword = 4,
+    Qword = 8,
+};
+
+/**
+ * Immediates only record their value and width; the emitter writes them
+ * straight into the code buffer in little-endian order.
+ */
+struct Imm8 {
+    static const size_t length = 1;
+    unsigned char value{0};
+    constexpr explicit Imm8(unsigned char val) : value(val) {}
+};
+
+struct Imm16 {
+    static const size_t length = 2;
+    unsigned short value{0};
+    constexpr explicit Imm16(unsigned short val) : value(val) {}
+};
+
+struct Imm32 {
+    static const size_t length = 4;
+    unsigned int value{0};
+    constexpr explicit Imm32(unsigned int val) : value(val) {}
+};
+
+struct Imm64 {
+    static const size_t length = 8;
+    unsigned long long value{0};
+    constexpr explicit Imm64(unsigned long long val) : value(val) {}
+};
+
+/**
+ * Finished code in a read-only executable mapping, which is unmapped when
+ * the Function goes away. An empty Function means no code could be
+ * installed.
+ */
+struct Function {
+    Function() {}
+    Function(char *code, size_t length, size_t mapped)
+        : code(code), length(length), mapped(mapped) {}
+    Function(const Function &) = delete;
+    Function &operator=(const Function &) = delete;
+    Function(Function &&other) { *this = std::move(other); }
+    Function &operator=(Function &&other) {
+        std::swap(code, other.code);
+        std::swap(length, other.length);
+        std::swap(mapped, other.mapped);
+        return *this;
+    }
+    ~Function() {
+        if (code != nullptr) {
+            munmap(code, mapped);
+        }
+    }
+
+    bool valid() { return code != nullptr; }
+    FnPointer entry() { return (FnPointer)code; }
+    /**
+     * The machine code, which does not depend on where it is loaded
+     */
+    const char *data() { return code; }
+    size_t size() { return length; }
+
+  private:
+    char *code{nullptr};
+    size_t length{0};
+    size_t mapped{0};
+};
+
+/**
+ * Growable page-backed buffer that code is generated into and later run
+ * from, so finished code never has to be copied. The pages are writable
+ * but not executable until make_executable flips them, so no mapping is
+ * ever both. Growing uses mremap, which can move the mapping, so positions
+ * are kept as offsets until the code is complete. If memory cannot be
+ * mapped, later writes are dropped and failed() reports it, as it does
+ * after fail().
+ */
+struct CodeBuffer {
+    static const size_t initial_capacity = 1 << 16;
+
+    CodeBuffer() {}
+    CodeBuffer(const CodeBuffer &) = delete;
+    CodeBuffer &operator=(const CodeBuffer &) = delete;
+    CodeBuffer(CodeBuffer &&other) { *this = std::move(other); }
+    CodeBuffer &operator=(CodeBuffer &&other) {
+        std::swap(memory, other.memory);
+        std::swap(used, other.used);
+        std::swap(capacity, other.capacity);
+        std::swap(failed_code, other.failed_code);
+        return *this;
+    }
+    ~CodeBuffer() {
+        if (memory != nullptr) {
+            munmap(memory, capacity);
+        }
+    }
+
+    void push_back(char byte) {
+        if (reserve(used + 1)) {
+            memory[used++] = byte;
+        }
+    }
+    template <typename Imm> void append(Imm imm) {
+        if (reserve(used + Imm::length)) {
+            used += Imm::length;
+            patch(used - Imm::length, imm.value, Imm::length);
+        }
+    }
+    void fill(size_t count, char byte) {
+        if (reserve(used + count)) {
+            memset(memory + used, byte, count);
+            used += count;
+        }
+    }
+    /**
+     * Overwrites the low size bytes of value at position
+     */
+    void patch(size_t position, unsigned long long value, size_t size) {
+        if (position + size > used) {
+            return;
+        }
+        for (size_t i = 0; i < size; i++) {
+            memory[position + i] = value & 0xff;
+            value >>= 8;
+        }
+    }
+    char *data() { return memory; }
+    size_t size() { return used; }
+    /**
+     * Remaps the code read-only and executable and hands it over. Returns
+     * an empty Function if writing the code failed or the host refuses to
+     * make the pages executable.
+     */
+    Function make_executable() {
+        if (failed_code || memory == nullptr ||
+            mprotect(memory, capacity, PROT_READ | PROT_EXEC) < 0) {
+            return Function();
+        }
+        Function function(memory, used, capacity);
+        memory = nullptr;
+        used = 0;
+        capacity = 0;
+        return function;
+    }
+    bool failed() { return failed_code; }
+    /**
+     * Marks the code as unusable
+     */
+    void fail() { failed_code = true; }
+
+  private:
+    bool reserve(size_t size) {
+        if (size <= capacity) {
+            return true;
+        }
+        if (failed_code) {
+            return false;
+        }
+        size_t new_capacity = capacity == 0 ? initial_capacity : capacity;
+        while (new_capacity < size) {
+            new_capacity *= 2;
+        }
+        void *new_memory;
+        if (memory == nullptr) {
+            new_memory = mmap(0, new_capacity, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        } else {
+            new_memory =
+                mremap(memory, capacity, new_capacity, MREMAP_MAYMOVE);
+        }
+        if (new_memory == MAP_FAILED) {
+            failed_code = true;
+            return false;
+        }
+        memory = (char *)new_memory;
+        capacity = new_capacity;
+        return true;
+    }
+
+    char *memory{nullptr};
+    size_t used{0};
+    size_t capacity{0};
+    bool failed_code{false};
+};
+
+/**
+ * A position in the emitted code that jumps can target before it is known.
+ */
+struct Label {
+    int id{-1};
+};
+
+struct Emitter {
+    void ret() { buffer.push_back(0xC3); }
+    void push(Register64 src) { buffer.push_back(0x50 | (int)src); }
+    void pop(Register64 dst) { buffer.push_back(0x58 | (int)dst); }
+    void mov(Register32 dst, Imm32 src) {
+        buffer.push_back(0xB8 | (int)dst);
+        buffer.append(src);
+    }
+    void mov(Register64 dst, Imm64 src) {
+        buffer.push_back(0x48);
+        buffer.push_back(0xB8 | (int)dst);
+        buffer.append(src);
+    }
+    void mov(Register64 dst, Register64 src) {
+        buffer.push_back(0x48);
+        buffer.push_back(0x89);
+        buffer.push_back(0xc0 | ((int)src) << 3 | (int)dst);
+    }
+    /**
+     * mov dst, [src + disp]
+     */
+    void mov_deref(Register8 dst, Register64 src, int disp = 0) {
+        buffer.push_back(0x8A);
+        address((int)dst, src, disp);
+    }
+    /**
+     * mov [dst + disp], src
+     */
+    void deref_mov(Register64 dst, Register8 src, int disp = 0) {
+        buffer.push_back(0x88);
+        address((int)src, dst, disp);
+    }
+    /**
+     * mov [dst + disp], src with src truncated to width, or sign-extended
+     * from 32 bits for Qword
+     */
+    void deref_mov(Width width, Register64 dst, int src, int disp = 0) {
+        operand_size(width);
+        buffer.push_back(width == Width::Byte ? 0xC6 : 0xC7);
+        address(0, dst, disp);
+        immediate(width, src);
+    }
+    /**
+     * mov [dst + disp], src using the low width bytes of src
+     */
+    void deref_mov(Width width, Register64 dst, Register64 src,
+                   int disp = 0) {
+        operand_size(width);
+        buffer.push_back(width == Width::Byte ? 0x88 : 0x89);
+        address((int)src, dst, disp);
+    }
+    /**
+     * mov dst, [src + disp]
+     */
+    void mov_deref(Register64 dst, Register64 src, int disp = 0) {
+        buffer.push_back(0x48);
+        buffer.push_back(0x8B);
+        address((int)dst, src, disp);
+    }
+    /**
+     * mov [dst + disp], src
+     */
+    void deref_mov(Register64 dst, Register64 src, int disp = 0) {
+        buffer.push_back(0x48);
+        buffer.push_back(0x89);
+        address((int)src, dst, disp);
+    }
+    void add(Register32 dst, Imm32 src) {
+        buffer.push_back(0x81);
+        buffer.push_back(0xC0 | (int)dst);
+        buffer.append(src);
+    }
+    void add(Register32 dst, Register32 src) {
+        buffer.push_back(0x01);
+        buffer.push_back(0xC0 | ((int)src) << 3 | (int)dst);
+    }
+    void add(Register64 dst, Imm32 src) {
+        buffer.push_back(0x48);
+        buffer.push_back(0x81);
+        buffer.push_back(0xC0 | (int)dst);
+        buffer.append(src);
+    }
+    void sub(Register32 dst, Imm32 src) {
+        buffer.push_back(0x81);
+        buffer.push_back(0xE8 | (int)dst);
+        buffer.append(src);
+    }
+    void sub(Register64 dst, Imm32 src) {
+        buffer.push_back(0x48);
+        buffer.push_back(0x81);
+        buffer.push_back(0xE8 | (int)dst);
+        buffer.append(src);
+    }
+    void al_add(Imm8 src) {
+        buffer.push_back(0x04);
+        buffer.append(src);
+    }
+    void al_sub(Imm8 src) {
+        buffer.push_back(0x2C);
+        buffer.append(src);
+    }
+    void cmp(Register32 dst, Imm32 src) {
+        // FIXME: This only compares with EAX
+        buffer.push_back(0x3D);
+        buffer.append(src);
+    }
+    /**
+     * cmp dst, [src + disp]
+     */
+    void cmp_deref(Register64 dst, Register64 src, int disp = 0) {
+        buffer.push_back(0x48);
+        buffer.push_back(0x3B);
+        address((int)dst, src, disp);
+    }
+    /**
+     * cmp [dst + disp], src at the given width
+     */
+    void cmp_deref(Width width, Register64 dst, int src, int disp = 0) {
+        group1_deref(7, width, dst, src, disp);
+    }
+    void test(Register32 dst, Register32 src) {
+        buffer.push_back(0x85);
+        buffer.push_back(0xC0 | ((int)src) << 3 | (int)dst);
+    }
+    void and_(Register32 dst, Imm32 src) {
+        buffer.push_back(0x81);
+        buffer.push_back(0xE0 | (int)dst);
+        buffer.append(src);
+    }
+    void and_(Register32 dst, Register32 src) {
+        buffer.push_back(0x21);
+        buffer.push_back(0xC0 | ((int)src) << 3 | (int)dst);
+    }
+    void mov(Register32 dst, Register32 src) {
+        buffer.push_back(0x89);
+        buffer.push_back(0xC0 | ((int)src) << 3 | (int)dst);
+    }
+    /**
+     * shr dst, cl
+     */
+    void shr_cl(Register32 dst) {
+        buffer.push_back(0xD3);
+        buffer.push_back(0xE8 | (int)dst);
+    }
+    /**
+     * shl dst, cl
+     */
+    void shl_cl(Register32 dst) {
+        buffer.push_back(0xD3);
+        buffer.push_back(0xE0 | (int)dst);
+    }
+    void sub(Register32 dst, Register32 src) {
+        buffer.push_back(0x29);
+        buffer.push_back(0xC0 | ((int)src) << 3 | (int)dst);
+    }
+    void and_(Register64 dst, Imm32 src) {
+        buffer.push_back(0x48);
+        buffer.push_back(0x81);
+        buffer.push_back(0xE0 | (int)dst);
+        buffer.append(src);
+    }
+    void shr(Register32 dst, Imm8 count) {
+        buffer.push_back(0xC1);
+        buffer.push_back(0xE8 | (int)dst);
+        buffer.append(count);
+    }
+    void add(Register64 dst, Register64 src) {
+        buffer.push_back(0x48);
+        buffer.push_back(0x01);
+        buffer.push_back(0xC0 | ((int)src) << 3 | (int)dst);
+    }
+    void sub(Register64 dst, Register64 src) {
+        buffer.push_back(0x48);
+        buffer.push_back(0x29);
+        buffer.push_back(0xC0 | ((int)src) << 3 | (int)dst);
+    }
+    void test(Register64 dst, Register64 src) {
+        buffer.push_back(0x48);
+        buffer.push_back(0x85);
+        buffer.push_back(0xC0 | ((int)src) << 3 | (int)dst);
+    }
+    /**
+     * Bit scan forward: index of the lowest set bit of src
+     */
+    void bsf(Register32 dst, Register32 src) {
+        buffer.push_back(0x0F);
+        buffer.push_back(0xBC);
+        buffer.push_back(0xC0 | ((int)dst) << 3 | (int)src);
+    }
+    /**
+     * Bit scan reverse: index of the highest set bit of src
+     */
+    void bsr(Register32 dst, Register32 src) {
+        buffer.push_back(0x0F);
+        buffer.push_back(0xBD);
+        buffer.push_back(0xC0 | ((int)dst) << 3 | (int)src);
+    }
+    void pxor(Register128 dst, Register128 src) {
+        buffer.push_back(0x66);
+        buffer.push_back(0x0F);
+        buffer.push_back(0xEF);
+        buffer.push_back(0xC0 | ((int)dst) << 3 | (int)src);
+    }
+    /**
+     * movdqu dst, [src + disp]
+     */
+    void movdqu_deref(Register128 dst, Register64 src, int disp) {
+        buffer.push_back(0xF3);
+        buffer.push_back(0x0F);
+        buffer.push_back(0x6F);
+        address((int)dst, src, disp);
+    }
+    void pcmpeqb(Register128 dst, Register128 src) {
+        buffer.push_back(0x66);
+        buffer.push_back(0x0F);
+        buffer.push_back(0x74);
+        buffer.push_back(0xC0 | ((int)dst) << 3 | (int)src);
+    }
+    void pmovmskb(Register32 dst, Register128 src) {
+        buffer.push_back(0x66);
+        buffer.push_back(0x0F);
+        buffer.push_back(0xD7);
+        buffer.push_back(0xC0 | ((int)dst) << 3 | (int)src);
+    }
+    void vpxor(Register256 dst, Register256 src1, Register256 src2) {
+        vex(0b01, src1);
+        buffer.push_back(0xEF);
+        buffer.push_back(0xC0 | ((int)dst) << 3 | (int)src2);
+    }
+    /**
+     * vmovdqu dst, [src + disp]
+     */
+    void vmovdqu_deref(Register256 dst, Register64 src, int disp) {
+        vex(0b10, Register256::YMM0);
+        buffer.push_back(0x6F);
+        address((int)dst, src, disp);
+    }
+    void vpcmpeqb(Register256 dst, Register256 src1, Register256 src2) {
+        vex(0b01, src1);
+        buffer.push_back(0x74);
+        buffer.push_back(0xC0 | ((int)dst) << 3 | (int)src2);
+    }
+    void vpmovmskb(Register32 dst, Register256 src) {
+        vex(0b01, Register256::YMM0);
+        buffer.push_back(0xD7);
+        buffer.push_back(0xC0 | ((int)dst) << 3 | (int)src);
+    }
+    void vzeroupper() {
+        buffer.push_back(0xC5);
+        buffer.push_back(0xF8);
+        buffer.push_back(0x77);
+    }
+    void cmp_al(Imm8 src) {
+        buffer.push_back(0x3C);
+        buffer.append(src);
+    }
+    void jmp(Imm32 offset) {
+        buffer.push_back(0xE9);
+        buffer.append(offset);
+    }
+    void jz(Imm32 offset) {
+        buffer.push_back(0x0F);
+        buffer.push_back(0x84);
+        buffer.append(offset);
+    }
+    void jnz(Imm32 offset) {
+        buffer.push_back(0x0F);
+        buffer.push_back(0x85);
+        buffer.append(offset);
+    }
+    void jz(Label target) {
+        buffer.push_back(0x0F);
+        buffer.push_back(0x84);
+        rel32(target);
+    }
+    void jnz(Label target) {
+        buffer.push_back(0x0F);
+        buffer.push_back(0x85);
+        rel32(target);
+    }
+    void jz_short(Label target) {
+        buffer.push_back(0x74);
+        rel8(target);
+    }
+    void jnz_short(Label target) {
+        buffer.push_back(0x75);
+        rel8(target);
+    }
+    void jb_short(Label target) {
+        buffer.push_back(0x72);
+        rel8(target);
+    }
+    void jmp_short(Label target) {
+        buffer.push_back(0xEB);
+        rel8(target);
+    }
+    void jle_short(Label target) {
+        buffer.push_back(0x7E);
+        rel8(target);
+    }
+    void jg_short(Label target) {
+        buffer.push_back(0x7F);
+        rel8(target);
+    }
+    void call(Label target) {
+        buffer.push_back(0xE8);
+        rel32(target);
+    }
+    void call(Imm32 offset) {
+        buffer.push_back(0xE8);
+        buffer.append(offset);
+    }
+    /**
+     * lea dst, [rip + target]
+     */
+    void lea(Register64 dst, Label target) {
+        buffer.push_back(0x48);
+        buffer.push_back(0x8D);
+        buffer.push_back(0x05 | (int)dst << 3);
+        rel32(target);
+    }
+    /**
+     * call [src + disp]
+     */
+    void call_deref(Register64 src, int disp = 0) {
+        buffer.push_back(0xFF);
+        address(2, src, disp);
+    }
+
+    /**
+     * Loads width bytes from [src + disp] into dst, zero-extended
+     */
+    void movzx_deref(Width width, Register64 dst, Register64 src,
+                     int disp = 0) {
+        switch (width) {
+        case Width::Byte:
+            buffer.push_back(0x0F);
+            buffer.push_back(0xB6);
+            break;
+        case Width::Word:
+            buffer.push_back(0x0F);
+            buffer.push_back(0xB7);
+            break;
+        case Width::Dword:
+            // Writing a 32-bit register clears the upper half
+            buffer.push_back(0x8B);
+            break;
+        case Width::Qword:
+            buffer.push_back(0x48);
+            buffer.push_back(0x8B);
+            break;
+        }
+        address((int)dst, src, disp);
+    }
+    /**
+     * add [dst + disp], src using the low width bytes of src
+     */
+    void add_deref(Width width, Register64 dst, Register64 src,
+                   int disp = 0) {
+        operand_size(width);
+        buffer.push_back(width == Width::Byte ? 0x00 : 0x01);
+        address((int)src, dst, disp);
+    }
+    /**
+     * add [dst + disp], src at the given width
+     */
+    void add_deref(Width width, Register64 dst, int src, int disp = 0) {
+        group1_deref(0, width, dst, src, disp);
+    }
+    /**
+     * sub [dst + disp], src at the given width
+     */
+    void sub_deref(Width width, Register64 dst, int src, int disp = 0) {
+        group1_deref(5, width, dst, src, disp);
+    }
+    /**
+     * sub [dst + disp], src using the low width bytes of src
+     */
+    void sub_deref(Width width, Register64 dst, Register64 src,
+                   int disp = 0) {
+        operand_size(width);
+        buffer.push_back(width == Width::Byte ? 0x28 : 0x29);
+        address((int)src, dst, disp);
+    }
+    /**
+     * imul dst, src, imm
+     */
+    void imul(Register32 dst, Register32 src, Imm32 imm) {
+        buffer.push_back(0x69);
+        buffer.push_back(0xC0 | ((int)dst) << 3 | (int)src);
+        buffer.append(imm);
+    }
+    /**
+     * imul dst, src, imm with imm sign-extended to 64 bits
+     */
+    void imul(Register64 dst, Register64 src, Imm32 imm) {
+        buffer.push_back(0x48);
+        imul((Register32)dst, (Register32)src, imm);
+    }
+    /**
+     * lea dst, [src + src * scale], scale being 1, 2, 4 or 8
+     */
+    void lea_scaled(Register32 dst, Register32 src, int scale) {
+        int scale_bits = scale == 8 ? 3 : scale == 4 ? 2 : scale == 2 ? 1 : 0;
+        buffer.push_back(0x8D);
+        buffer.push_back(((int)dst) << 3 | 0b100);
+        buffer.push_back(scale_bits << 6 | ((int)src) << 3 | (int)src);
+    }
+    void lea_scaled(Register64 dst, Register64 src, int scale) {
+        buffer.push_back(0x48);
+        lea_scaled((Register32)dst, (Register32)src, scale);
+    }
+
+    void syscall() {
+        buffer.push_back(0x0F);
+        buffer.push_back(0x05);
+    }
+
+    Label new_label() {
+        labels.push_back(-1);
+        return Label{(int)labels.size() - 1};
+    }
+    /**
+     * Binds the label to the current position
+     */
+    void bind(Label label) { labels[label.id] = buffer.size(); }
+    /**
+     * Patches every rel8/rel32 slot with the distance to its label. All
+     * labels must be bound by now. A short jump that cannot reach its label
+     * fails the code.
+     */
+    void resolve_labels() {
+        for (auto &fixup : fixups) {
+            int offset = labels[fixup.label] - (fixup.position + fixup.size);
+            if (fixup.size == 1 && (offset < -128 || offset > 127)) {
+                buffer.fail();
+            }
+            buffer.patch(fixup.position, offset, fixup.size);
+        }
+        fixups.clear();
+    }
+
+    CodeBuffer &code() { return buffer; }
+    /**
+     * Returns the length of the instructions already emitted
+     */
+    std::size_t length() { return buffer.size(); }
+
+  private:
+    struct Fixup {
+        size_t position;
+        int size;
+        int label;
+    };
+
+    /**
+     * Emits a placeholder rel32 to be patched by resolve_labels
+     */
+    void rel32(Label target) {
+        fixups.push_back({buffer.size(), 4, target.id});
+        buffer.fill(4, 0);
+    }
+    /**
+     * Emits a placeholder rel8 to be patched by resolve_labels
+     */
+    void rel8(Label target) {
+        fixups.push_back({buffer.size(), 1, target.id});
+        buffer.push_back(0);
+    }
+    /**
+     * Emits the ModRM byte and displacement for [base + disp], picking the
+     * shortest displacement. RSP needs a SIB byte and is not supported as a
+     * base.
+     */
+    void address(int reg, Register64 base, int disp) {
+        if (disp == 0 && base != Register64::RBP) {
+            buffer.push_back(reg << 3 | (int)base);
+        } else if (disp >= -128 && disp <= 127) {
+            buffer.push_back(0x40 | reg << 3 | (int)base);
+            buffer.push_back(disp);
+        } else {
+            buffer.push_back(0x80 | reg << 3 | (int)base);
+            buffer.append(Imm32(disp));
+        }
+    }
+
+    /**
+     * Emits `op [dst + disp], src` for the 80/81/83 group, whose ModRM reg
+     * field selects the operation. Wider operands use the sign-extended
+     * 8-bit immediate form when src fits in it.
+     */
+    void group1_deref(int op, Width width, Register64 dst, int src,
+                      int disp) {
+        operand_size(width);
+        bool short_immediate = src >= -128 && src <= 127;
+        if (width == Width::Byte) {
+            buffer.push_back(0x80);
+        } else {
+            buffer.push_back(short_immediate ? 0x83 : 0x81);
+        }
+        address(op, dst, disp);
+        if (width == Width::Byte || short_immediate) {
+            buffer.append(Imm8(src));
+        } else {
+            immediate(width, src);
+        }
+    }
+    /**
+     * Operand size prefix selecting a 16 or 64-bit operation over the
+     * default 32-bit one. Byte operations use their own opcodes.
+     */
+    void operand_size(Width width) {
+        if (width == Width::Word) {
+            buffer.push_back(0x66);
+        } else if (width == Width::Qword) {
+            buffer.push_back(0x48);
+        }
+    }
+    /**
+     * Immediate of a width-sized operation; 64-bit operations take a 32-bit
+     * immediate that the CPU sign-extends.
+     */
+    void immediate(Width width, int value) {
+        if (width == Width::Byte) {
+            buffer.append(Imm8(value));
+        } else if (width == Width::Word) {
+            buffer.append(Imm16(value));
+        } else {
+            buffer.append(Imm32(value));
+        }
+    }
+
+    /**
+     * Two byte VEX prefix for a 256-bit operation in the 0F opcode map.
+     * pp selects the implied 66/F3/F2 prefix, vvvv the extra source.
+     */
+    void vex(int pp, Register256 vvvv) {
+        buffer.push_back(0xC5);
+        buffer.push_back(0x80 | ((~(int)vvvv) & 0xF) << 3 | 0x04 | pp);
+    }
+
+    CodeBuffer buffer;
+    std::vector<size_t> labels;
+    std::vector<Fixup> fixups;
+};
+
+struct Compiler {
+    Compiler() {}
+    explicit Compiler(const Options &options, bool use_avx2 = supports_avx2())
+        : options(options), width((Width)(options.cell_bits / 8)),
+          use_avx2(use_avx2) {}
+
+    /**
+     * Whether scans use AVX2, which changes the generated code
+     */
+    static bool supports_avx2() { return __builtin_cpu_supports("avx2"); }
+
+    /**
+     * Strides whose positions form a fixed bit pattern in a vector compare
+     * mask, so the scan can test a whole vector of cells at once.
+     */
+    bool is_vector_stride(int stride) {
+        long long bytes = stride < 0 ? -(long long)stride : stride;
+        bytes *= (int)width;
+        return bytes == 1 || bytes == 2 || bytes == 4 || bytes == 8 ||
+               bytes == 16;
+    }
+    /**
+     * RCX holds the tape pointer, RBP the Runtime and RBX saves RCX across
+     * calls. The extra 8 bytes keep the stack aligned for the hooks.
+     */
+    void compile_setup(Emitter &emitter) {
+        emitter.push(Register64::RBX);
+        emitter.push(Register64::RBP);
+        emitter.sub(Register64::RSP, Imm32(8));
+        emitter.mov(Register64::RCX, Register64::RDI);
+        emitter.mov(Register64::RBP, Register64::RSI);
+    }
+    void compile_cleanup(Emitter &emitter) {
+        compile_hook_call(offsetof(Runtime, flush), emitter);
+        emitter.mov(Register64::RAX, Imm64(0));
+        emitter.add(Register64::RSP, Imm32(8));
+        emitter.pop(Register64::RBP);
+        emitter.pop(Register64::RBX);
+        emitter.ret();
+    }
+    /**
+     * Ends code that runs on behalf of an interpreter: hands the tape
+     * pointer back and leaves the output buffered.
+     */
+    void compile_return_head(Emitter &emitter) {
+        emitter.mov(Register64::RAX, Register64::RCX);
+        emitter.add(Register64::RSP, Imm32(8));
+        emitter.pop(Register64::RBP);
+        emitter.pop(Register64::RBX);
+        emitter.ret();
+    }
+    void compile_add(Instruction insn, Emitter &emitter) {
+        emitter.add_deref(width, Register64::RCX, insn.value,
+                          disp(insn.offset));
+    }
+    void compile_sub(Instruction insn, Emitter &emitter) {
+        emitter.sub_deref(width, Register64::RCX, insn.value,
+                          disp(insn.offset));
+    }
+    void compile_set(Instruction insn, Emitter &emitter) {
+        emitter.deref_mov(width, Register64::RCX, insn.value,
+                          disp(insn.offset));
+    }
+    /**
+     * Expects cell[offset] to be zero-extended in RAX, see
+     * compile_load_factor. Products are computed in 32 bits unless cells
+     * are wider, since only the low width bytes are stored.
+     */
+    void compile_mul_add(Instruction insn, Emitter &emitter) {
+        int factor = insn.mul.factor;
+        int target = disp(insn.target());
+        if (factor == 1) {
+            emitter.add_deref(width, Register64::RCX, Register64::RAX, target);
+            return;
+        }
+        if (factor == -1) {
+            emitter.sub_deref(width, Register64::RCX, Register64::RAX, target);
+            return;
+        }
+        bool lea = factor == 2 || factor == 3 || factor == 5 || factor == 9;
+        if (width == Width::Qword && lea) {
+            emitter.lea_scaled(Register64::RDX, Register64::RAX, factor - 1);
+        } else if (width == Width::Qword) {
+            emitter.imul(Register64::RDX, Register64::RAX, Imm32(factor));
+        } else if (lea) {
+            emitter.lea_scaled(Register32::EDX, Register32::EAX, factor - 1);
+        } else {
+            emitter.imul(Register32::EDX, Register32::EAX, Imm32(factor));
+        }
+        emitter.add_deref(width, Register64::RCX, Register64::RDX, target);
+    }
+    /**
+     * Loads cell[offset] for a run of MulAdds and jumps to skip if it is
+     * zero, so the run never touches cells the loop it replaces would not
+     * have reached.
+     */
+    void compile_load_factor(Instruction insn, Label skip, Emitter &emitter) {
+        emitter.movzx_deref(width, Register64::RAX, Register64::RCX,
+                            disp(insn.offset));
+        emitter.test(Register64::RAX, Register64::RAX);
+        emitter.jz(skip);
+    }
+    /**
+     * Scans whose stride spans 1, 2, 4, 8 or 16 bytes compare 16 (SSE2) or
+     * 32 (AVX2) bytes per iteration and mask out the positions that are not
+     * visited. The windows are aligned, so given an aligned first cell they
+     * never reach into a guard page unless the scan itself moves off the
+     * tape. Other strides use a plain compare loop.
+     */
+    void compile_scan(Instruction insn, Emitter &emitter) {
+        Label loop = emitter.new_label();
+        Label found = emitter.new_label();
+        if (!is_vector_stride(insn.value)) {
+            emitter.bind(loop);
+            emitter.cmp_deref(width, Register64::RCX, 0);
+            emitter.jz_short(found);
+            compile_move(insn.value, emitter);
+            emitter.jmp_short(loop);
+            emitter.bind(found);
+            return;
+        }
+        bool forward = insn.value > 0;
+        int step = (forward ? insn.value : -insn.value) * (int)width;
+        int vector = use_avx2 ? 32 : 16;
+        // Bits of the cells a scan visits in a window whose first (or last,
+        // going backward) position is visited
+        unsigned int visited = 0;
+        for (int i = 0; i < vector; i += step) {
+            visited |= forward ? 1u << i : 0x80000000u >> i;
+        }
+        unsigned int phase_zero = 0;
+        for (int i = 0; i < vector; i += step) {
+            phase_zero |= 1u << i;
+        }
+        Label first = emitter.new_label();
+        Label done = emitter.new_label();
+
+        if (use_avx2) {
+            emitter.vpxor(Register256::YMM0, Register256::YMM0,
+                          Register256::YMM0);
+        } else {
+            emitter.pxor(Register128::XMM0, Register128::XMM0);
+        }
+        // RSI walks the windows, EDI holds the position of the current
+        // cell in the first one
+        emitter.mov(Register64::RSI, Register64::RCX);
+        emitter.mov(Register32::EDI, Register32::ESI);
+        emitter.and_(Register32::EDI, Imm32(vector - 1));
+        emitter.and_(Register64::RSI, Imm32(-vector));
+        compile_scan_window(emitter);
+        // Drop the positions behind the current cell, lining it up with
+        // bit 0 going forward and bit 31 going backward
+        if (forward) {
+            emitter.mov(Register32::ECX, Register32::EDI);
+            emitter.shr_cl(Register32::EAX);
+        } else {
+            emitter.mov(Register32::ECX, Imm32(31));
+            emitter.sub(Register32::ECX, Register32::EDI);
+            emitter.shl_cl(Register32::EAX);
+        }
+        emitter.and_(Register32::EAX, Imm32(visited));
+        emitter.jnz_short(first);
+
+        // Later windows visit the positions congruent to the current cell
+        // modulo the stride
+        emitter.mov(Register32::ECX, Register32::EDI);
+        emitter.and_(Register32::ECX, Imm32(step - 1));
+        emitter.mov(Register32::EDI, Imm32(phase_zero));
+        emitter.shl_cl(Register32::EDI);
+        emitter.bind(loop);
+        if (forward) {
+            emitter.add(Register64::RSI, Imm32(vector));
+        } else {
+            emitter.sub(Register64::RSI, Imm32(vector));
+        }
+        compile_scan_window(emitter);
+        emitter.and_(Register32::EAX, Register32::EDI);
+        emitter.jz_short(loop);
+        if (forward) {
+            emitter.bsf(Register32::EAX, Register32::EAX);
+        } else {
+            emitter.bsr(Register32::EAX, Register32::EAX);
+        }
+        emitter.mov(Register64::RCX, Register64::RSI);
+        emitter.add(Register64::RCX, Register64::RAX);
+        emitter.jmp_short(done);
+
+        // The found bit is relative to the shifted mask: ECX still holds
+        // the shift, which a found bit going backward is at least
+        emitter.bind(first);
+        if (forward) {
+            emitter.bsf(Register32::EAX, Register32::EAX);
+            emitter.add(Register32::EAX, Register32::ECX);
+        } else {
+            emitter.bsr(Register32::EAX, Register32::EAX);
+            emitter.sub(Register32::EAX, Register32::ECX);
+        }
+        emitter.mov(Register64::RCX, Register64::RSI);
+        emitter.add(Register64::RCX, Register64::RAX);
+        emitter.bind(done);
+        if (use_avx2) {
+            emitter.vzeroupper();
+        }
+    }
+    /**
+     * Sets a bit in EAX for every zero cell of the aligned window at RSI,
+     * at the position of the cell's first byte. Clobbers EDX.
+     */
+    void compile_scan_window(Emitter &emitter) {
+        if (use_avx2) {
+            emitter.vmovdqu_deref(Register256::YMM1, Register64::RSI, 0);
+            emitter.vpcmpeqb(Register256::YMM1, Register256::YMM1,
+                             Register256::YMM0);
+            emitter.vpmovmskb(Register32::EAX, Register256::YMM1);
+        } else {
+            emitter.movdqu_deref(Register128::XMM1, Register64::RSI, 0);
+            emitter.pcmpeqb(Register128::XMM1, Register128::XMM0);
+            emitter.pmovmskb(Register32::EAX, Register128::XMM1);
+        }
+        // A wide cell is zero when all of its bytes are: fold the byte mask
+        // so the bit of each cell's first byte is the AND of all of them
+        for (int shift = 1; shift < (int)width; shift *= 2) {
+            emitter.mov(Register32::EDX, Register32::EAX);
+            emitter.shr(Register32::EDX, Imm8(shift));
+            emitter.and_(Register32::EAX, Register32::EDX);
+        }
+    }
+    void compile_right(Instruction insn, Emitter &emitter) {
+        compile_move(insn.value, emitter);
+    }
+    void compile_left(Instruction insn, Emitter &emitter) {
+        compile_move(-(long long)insn.value, emitter);
+    }
+    /**
+     * Moves the tape pointer by a number of cells, in several steps if the
+     * distance in bytes does not fit in an immediate.
+     */
+    void compile_move(long long cells, Emitter &emitter) {
+        const long long max_step = 0x7FFFFFFF;
+        long long bytes = cells * (int)width;
+        for (; bytes > max_step; bytes -= max_step) {
+            emitter.add(Register64::RCX, Imm32(max_step));
+        }
+        for (; bytes < -max_step; bytes += max_step) {
+            emitter.sub(Register64::RCX, Imm32(max_step));
+        }
+        if (bytes > 0) {
+            emitter.add(Register64::RCX, Imm32(bytes));
+        } else if (bytes < 0) {
+            emitter.sub(Register64::RCX, Imm32(-bytes));
+        }
+    }
+    /**
+     * Outputs the low byte of the cell.
+     */
+    void compile_write(Instruction insn, Emitter &emitter) {
+        emitter.mov_deref(Register64::RAX, Register64::RBP,
+                          offsetof(Runtime, out_cursor));
+        emitter.mov_deref(Register8::DL, Register64::RCX, disp(insn.offset));
+        emitter.deref_mov(Register64::RAX, Register8::DL);
+        emitter.add(Register64::RAX, Imm32(1));
+        emitter.deref_mov(Register64::RBP, Register64::RAX,
+                          offsetof(Runtime, out_cursor));
+        emitter.cmp_deref(Register64::RAX, Register64::RBP,
+                          offsetof(Runtime, out_end));
+        Label done = emitter.new_label();
+        emitter.jb_short(done);
+        compile_hook_call(offsetof(Runtime, flush), emitter);
+        emitter.bind(done);
+    }
+    /**
+     * Takes the next byte from the input buffer, calling the fill hook when
+     * it is empty. The hook leaves the buffer empty on end of input. Bytes
+     * are zero-extended into wider cells.
+     */
+    void compile_read(Instruction insn, Emitter &emitter) {
+        Label consume = emitter.new_label();
+        Label done = emitter.new_label();
+        compile_input_check(emitter);
+        emitter.jb_short(consume);
+        compile_hook_call(offsetof(Runtime, fill), emitter);
+        compile_input_check(emitter);
+        emitter.jb_short(consume);
+        if (options.eof == EofPolicy::Zero) {
+            emitter.deref_mov(width, Register64::RCX, 0, disp(insn.offset));
+        } else if (options.eof == EofPolicy::MinusOne) {
+            emitter.deref_mov(width, Register64::RCX, -1, disp(insn.offset));
+        }
+        emitter.jmp_short(done);
+
+        emitter.bind(consume);
+        emitter.movzx_deref(Width::Byte, Register64::RDX, Register64::RAX);
+        emitter.deref_mov(width, Register64::RCX, Register64::RDX,
+                          disp(insn.offset));
+        emitter.add(Register64::RAX, Imm32(1));
+        emitter.deref_mov(Register64::RBP, Register64::RAX,
+                          offsetof(Runtime, in_cursor));
+        emitter.bind(done);
+    }
+    /**
+     * Loads the input cursor into RAX and compares it with the end of the
+     * buffered input.
+     */
+    void compile_input_check(Emitter &emitter) {
+        emitter.mov_deref(Register64::RAX, Register64::RBP,
+                          offsetof(Runtime, in_cursor));
+        emitter.cmp_deref(Register64::RAX, Register64::RBP,
+                          offsetof(Runtime, in_end));
+    }
+    /**
+     * Calls one of the Runtime hooks with the Runtime as its argument,
+     * preserving the tape pointer.
+     */
+    void compile_hook_call(int hook, Emitter &emitter) {
+        emitter.mov(Register64::RBX, Register64::RCX);
+        emitter.mov(Register64::RDI, Register64::RBP);
+        emitter.call_deref(Register64::RBP, hook);
+        emitter.mov(Register64::RCX, Register64::RBX);
+    }
+    /**
+     * The loop is entered through a test at the top and repeated by a test
+     * at the bottom that jumps straight back into the body.
+     */
+    void compile_loop(Label body, Label end, Emitter &emitter) {
+        emitter.cmp_deref(width, Register64::RCX, 0);
+        emitter.jz(end);
+        emitter.bind(body);
+    }
+    void compile_end_loop(Label body, Label end, Emitter &emitter) {
+        emitter.cmp_deref(width, Register64::RCX, 0);
+        emitter.jnz(body);
+        emitter.bind(end);
+    }
+
+  private:
+    /**
+     * Byte displacement of the cell at offset
+     */
+    int disp(int offset) { return offset * (int)width; }
+
+    Options options;
+    Width width{Width::Byte};
+    bool use_avx2{false};
+};
+
+}; // namespace JIT
+
+/**
+ * Extracts the eight command bytes from source text. The vector paths
+ * classify 16 (SSSE3) or 32 (AVX2) bytes per compare and skip blocks with
+ * no commands outright. Blocks with some commands are packed 8 bytes at a
+ * time with pshufb, using a table of shuffles indexed by the match mask.
+ */
+struct CommandFilter {
+    /**
+     * Copies the commands in source to out and returns how many there were.
+     * out must have room for length + 16 bytes since the vector paths store
+     * whole 8 and 16 byte groups.
+     */
+    static size_t filter(const char *source, size_t length, char *out) {
+        static const auto implementation = select();
+        return implementation(source, length, out);
+    }
+
+  private:
+    struct ShuffleTable {
+        ShuffleTable() {
+            for (int mask = 0; mask < 256; mask++) {
+                int count = 0;
+                for (int bit = 0; bit < 8; bit++) {
+                    if (mask & (1 << bit)) {
+                        shuffles[mask][count++] = bit;
+                    }
+                }
+                for (int rest = count; rest < 8; rest++) {
+                    shuffles[mask][rest] = (char)0x80;
+                }
+                counts[mask] = count;
+            }
+        }
+        // Byte positions of the set bits of each mask, in order
+        char shuffles[256][8];
+        unsigned char counts[256];
+    };
+
+    typedef size_t (*Implementation)(const char *, size_t, char *);
+
+    static Implementation select() {
+        if (__builtin_cpu_supports("avx2")) {
+            return filter_avx2;
+        }
+        if (__builtin_cpu_supports("ssse3")) {
+            return filter_ssse3;
+        }
+        return filter_scalar;
+    }
+    static bool is_command(char c) {
+        return c == '+' || c == '-' || c == '<' || c == '>' || c == '[' ||
+               c == ']' || c == '.' || c == ',';
+    }
+    static size_t filter_scalar(const char *source, size_t length,
+                                char *out) {
+        size_t count = 0;
+        for (size_t i = 0; i < length; i++) {
+            if (is_command(source[i])) {
+                out[count++] = source[i];
+            }
+        }
+        return count;
+    }
+    /**
+     * Packs the bytes of block selected by the 8-bit mask to out and
+     * returns how many were written.
+     */
+    __attribute__((target("ssse3"))) static size_t
+    pack8(__m128i block, unsigned mask, char *out) {
+        static const ShuffleTable table;
+        __m128i shuffle =
+            _mm_loadl_epi64((const __m128i *)table.shuffles[mask]);
+        _mm_storel_epi64((__m128i *)out, _mm_shuffle_epi8(block, shuffle));
+        return table.counts[mask];
+    }
+    __attribute__((target("ssse3"))) static __m128i classify(__m128i block) {
+        // '+' ',' '-' '.' are contiguous, so one unsigned range check
+        // covers them: (c - '+') <= 3 is c == min(c - '+', 3) after
+        // saturation.
+        __m128i shifted = _mm_sub_epi8(block, _mm_set1_epi8('+'));
+        __m128i range = _mm_cmpeq_epi8(
+            _mm_min_epu8(shifted, _mm_set1_epi8(3)), shifted);
+        __m128i others = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('<')),
+                         _mm_cmpeq_epi8(block, _mm_set1_epi8('>'))),
+            _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('[')),
+                         _mm_cmpeq_epi8(block, _mm_set1_epi8(']'))));
+        return _mm_or_si128(range, others);
+    }
+    __attribute__((target("ssse3"))) static size_t
+    pack16(__m128i block, unsigned mask, char *out) {
+        if (mask == 0xFFFF) {
+            _mm_storeu_si128((__m128i *)out, block);
+            return 16;
+        }
+        size_t count = pack8(block, mask & 0xFF, out);
+        return count + pack8(_mm_srli_si128(block, 8), mask >> 8, out + count);
+    }
+    __attribute__((target("ssse3"))) static size_t
+    filter_ssse3(const char *source, size_t length, char *out) {
+        size_t count = 0;
+        size_t i = 0;
+        for (; i + 16 <= length; i += 16) {
+            __m128i block = _mm_loadu_si128((const __m128i *)(source + i));
+            unsigned mask = _mm_movemask_epi8(classify(block));
+            if (mask != 0) {
+                count += pack16(block, mask, out + count);
+            }
+        }
+        return count + filter_scalar(source + i, length - i, out + count);
+    }
+    __attribute__((target("avx2"))) static size_t
+    filter_avx2(const char *source, size_t length, char *out) {
+        size_t count = 0;
+        size_t i = 0;
+        for (; i + 32 <= length; i += 32) {
+            __m256i block = _mm256_loadu_si256((const __m256i *)(source + i));
+            __m256i shifted = _mm256_sub_epi8(block, _mm256_set1_epi8('+'));
+            __m256i range = _mm256_cmpeq_epi8(
+                _mm256_min_epu8(shifted, _mm256_set1_epi8(3)), shifted);
+            __m256i others = _mm256_or_si256(
+                _mm256_or_si256(
+                    _mm256_cmpeq_epi8(block, _mm256_set1_epi8('<')),
+                    _mm256_cmpeq_epi8(block, _mm256_set1_epi8('>'))),
+                _mm256_or_si256(
+                    _mm256_cmpeq_epi8(block, _mm256_set1_epi8('[')),
+                    _mm256_cmpeq_epi8(block, _mm256_set1_epi8(']'))));
+            unsigned mask =
+                _mm256_movemask_epi8(_mm256_or_si256(range, others));
+            if (mask == 0) {
+                continue;
+            }
+            count += pack16(_mm256_castsi256_si128(block), mask & 0xFFFF,
+                            out + count);
+            count += pack16(_mm256_extracti128_si256(block, 1), mask >> 16,
+                            out + count);
+        }
+        return count + filter_ssse3(source + i, length - i, out + count);
+    }
+};
+
+struct Compiler {
+    Compiler() {}
+
+    static constexpr size_t chunk_size = 1 << 14;
+
+    /**
+     * Parses the source, filtering out everything that is not a command a
+     * chunk at a time. A first pass only counts the commands to size the
+     * program, as sources can be mostly comments. Runs of '+'/'-' and
+     * '<'/'>' are coalesced even when comments separate them. Sets error if
+     * the loops do not match or memory runs out.
+     */
+    Program compile_program(const char *code, size_t length,
+                            std::string &error) {
+        char commands[chunk_size + 16];
+        size_t total = 0;
+        for (size_t start = 0; start < length; start += chunk_size) {
+            total += CommandFilter::filter(
+                code + start, std::min(chunk_size, length - start), commands);
+        }
+        Program program(total);
+        int arithmetic = 0;
+        long long movement = 0;
+        for (size_t start = 0; start < length; start += chunk_size) {
+            size_t count = CommandFilter::filter(
+                code + start, std::min(chunk_size, length - start), commands);
+            for (size_t i = 0; i < count; i++) {
+                parse_command(program, commands[i], arithmetic, movement);
+            }
+        }
+        flush_arithmetic(program, arithmetic);
+        flush_movement(program, movement);
+        error = program.failed() ? "Could not allocate memory for the program"
+                                : validate_loops(program);
+        return program;
+    }
+
+  private:
+    void parse_command(Program &program, char c, int &arithmetic,
+                       long long &movement) {
+        switch (c) {
+        case '+':
+        case '-':
+            flush_movement(program, movement);
+            arithmetic += c == '+' ? 1 : -1;
+            break;
+        case '>':
+        case '<':
+            flush_arithmetic(program, arithmetic);
+            movement += c == '>' ? 1 : -1;
+            break;
+        default:
+            flush_arithmetic(program, arithmetic);
+            flush_movement(program, movement);
+            program.append(command(c));
+            break;
+        }
+    }
+    std::string validate_loops(Program &program) {
+        int loop_depth = 0;
+        for (auto &insn : program.instructions) {
+            if (insn.type == Instruction::Type::Loop) {
+                loop_depth++;
+            } else if (insn.type == Instruction::Type::EndLoop) {
+                loop_depth--;
+                if (loop_depth < 0) {
+                    return "Invalid input program: Unmatched ']'";
+                }
+            }
+        }
+        if (loop_depth > 0) {
+            return "Invalid input program: Unmatched '['";
+        }
+        return "";
+    }
+    Instruction command(char c) {
+        switch (c) {
+        case '.':
+            return Instruction::write();
+        case ',':
+            return Instruction::read();
+        case '[':
+            return Instruction::loop();
+        default:
+            return Instruction::end_loop();
+        }
+    }
+    void flush_arithmetic(Program &program, int &total) {
+        if (total > 0) {
+            program.append(Instruction::add(total));
+        } else if (total < 0) {
+            program.append(Instruction::sub(-total));
+        }
+        total = 0;
+    }
+    void flush_movement(Program &program, long long &total) {
+        while (total > Instruction::max_move ||
+               total < -Instruction::max_move) {
+            int step = total > 0 ? Instruction::max_move
+                                 : -Instruction::max_move;
+            program.append(step > 0 ? Instruction::right(step)
+                                    : Instruction::left(-step));
+            // Adding 0 touches the cell without changing it
+            program.append(Instruction::add(0));
+            total -= step;
+        }
+        if (total > 0) {
+            program.append(Instruction::right(total));
+        } else if (total < 0) {
+            program.append(Instruction::left(-total));
+        }
+        total = 0;
+    }
+};
+
+/**
+ * Rewrites common loop idioms in a Program into dedicated instructions.
+ */
+struct Optimizer {
+    Optimizer() {}
+    explicit Optimizer(const Options &options)
+        : cell_bits(options.cell_bits) {}
+
+    /**
+     * Returns the optimized copy of program. Sets error if memory runs out.
+     */
+    Program optimize(Program &program, std::string &error) {
+        Program result(program.instructions.size());
+        auto &instructions = program.instructions;
+        for (size_t i = 0; i < instructions.size(); i++) {
+            if (instructions[i].type == Instruction::Type::Loop) {
+                size_t end = innermost_loop_end(program, i);
+                if (end != 0 && append_loop(result, program, i, end)) {
+                    i = end;
+                    continue;
+                }
+            }
+            append_folded(result, instructions[i]);
+        }
+        assign_offsets(result);
+        if (result.failed()) {
+            error = "Could not allocate memory for the program";
+        }
+        return result;
+    }
+
+  private:
+    /**
+     * Returns the position of the EndLoop closing the loop at position if
+     * the body has no nested loops, and 0 otherwise.
+     */
+    size_t innermost_loop_end(Program &program, size_t position) {
+        auto &instructions = program.instructions;
+        for (size_t i = position + 1; i < instructions.size(); i++) {
+            if (instructions[i].type == Instruction::Type::Loop) {
+                return 0;
+            }
+            if (instructions[i].type == Instruction::Type::EndLoop) {
+                return i;
+            }
+        }
+        return 0;
+    }
+    /**
+     * Replaces the innermost loop between begin and end with dedicated
+     * instructions if it matches a known idiom.
+     */
+    bool append_loop(Program &result, Program &program, size_t begin,
+                     size_t end) {
+        if (end - begin == 2) {
+            Instruction body = program.instructions[begin + 1];
+            if (is_clear_loop(body)) {
+                append_set(result, 0);
+                return true;
+            }
+            if (body.type == Instruction::Type::Right) {
+                result.append(Instruction::scan(body.value));
+                return true;
+            }
+            if (body.type == Instruction::Type::Left) {
+                result.append(Instruction::scan(-body.value));
+                return true;
+            }
+        }
+        return append_multiply_loop(result, program, begin, end);
+    }
+    /**
+     * Matches the body of `[-]` and `[+]` (or any odd step), which always
+     * leave the cell at zero.
+     */
+    bool is_clear_loop(Instruction body) {
+        return (body.type == Instruction::Type::Add ||
+                body.type == Instruction::Type::Sub) &&
+               body.value % 2 == 1;
+    }
+    /**
+     * Matches loops such as `[->+>++<<]` whose body only does arithmetic,
+     * returns to the cell it started on and steps that cell by one. These
+     * are replaced by one MulAdd per touched cell followed by Set(0).
+     */
+    bool append_multiply_loop(Program &result, Program &program, size_t begin,
+                              size_t end) {
+        long long offset = 0;
+        Deltas deltas;
+        for (size_t i = begin + 1; i < end; i++) {
+            Instruction insn = program.instructions[i];
+            switch (insn.type) {
+            case Instruction::Type::Right:
+                offset += insn.value;
+                break;
+            case Instruction::Type::Left:
+                offset -= insn.value;
+                break;
+            case Instruction::Type::Add:
+                deltas.add(offset, insn.value);
+                break;
+            case Instruction::Type::Sub:
+                deltas.add(offset, -insn.value);
+                break;
+            default:
+                return false;
+            }
+            // MulAdd distances are 16 bits, so give up as soon as the loop
+            // wanders farther than that
+            if (offset < -32768 || offset > 32767) {
+                return false;
+            }
+        }
+        if (offset != 0) {
+            return false;
+        }
+        long long step = 0;
+        for (auto &delta : deltas.list) {
+            long long factor = wrap(delta.second);
+            if (delta.first == 0) {
+                step = factor;
+            }
+            if (factor < -32767 || factor > 32767) {
+                return false;
+            }
+        }
+        // The loop runs cell[0] times when stepping by -1 and -cell[0]
+        // times when stepping by +1.
+        int sign;
+        if (step == -1) {
+            sign = 1;
+        } else if (step == 1) {
+            sign = -1;
+        } else {
+            return false;
+        }
+        for (auto &delta : deltas.list) {
+            int factor = wrap(delta.second);
+            if (delta.first != 0 && factor != 0) {
+                result.append(Instruction::mul_add(delta.first, sign * factor));
+            }
+        }
+        append_set(result, 0);
+        return true;
+    }
+    /**
+     * Reduces value modulo the cell size into the signed range of a cell
+     */
+    long long wrap(long long value) {
+        if (cell_bits >= 64) {
+            return value;
+        }
+        long long modulus = 1ll << cell_bits;
+        value %= modulus;
+        if (value >= modulus / 2) {
+            value -= modulus;
+        } else if (value < -modulus / 2) {
+            value += modulus;
+        }
+        return value;
+    }
+    /**
+     * Net change per cell offset of a loop body, in the order the cells are
+     * first touched
+     */
+    struct Deltas {
+        void add(int offset, long long value) {
+            auto found = positions.emplace(offset, list.size());
+            if (found.second) {
+                list.push_back({offset, value});
+            } else {
+                list[found.first->second].second += value;
+            }
+        }
+
+        std::vector<std::pair<int, long long>> list;
+        std::unordered_map<int, size_t> positions;
+    };
+    /**
+     * Folds the pointer movement of straight-line code into the cell
+     * offsets of its instructions, leaving a single Right/Left before each
+     * loop boundary and Scan, whose movement is only known at run time.
+     * Works in place since every emitted move replaces at least one.
+     */
+    void assign_offsets(Program &program) {
+        auto &instructions = program.instructions;
+        size_t out = 0;
+        int offset = 0;
+        for (size_t i = 0; i < instructions.size(); i++) {
+            Instruction insn = instructions[i];
+            switch (insn.type) {
+            case Instruction::Type::Right:
+            case Instruction::Type::Left: {
+                long long moved = offset;
+                moved += insn.type == Instruction::Type::Right ? insn.value
+                                                               : -insn.value;
+                if (moved < -Instruction::max_offset ||
+                    moved > Instruction::max_offset) {
+                    out = append_move(instructions, out, moved);
+                    offset = 0;
+                } else {
+                    offset = moved;
+                }
+                continue;
+            }
+            case Instruction::Type::Loop:
+            case Instruction::Type::EndLoop:
+            case Instruction::Type::Scan:
+                out = append_move(instructions, out, offset);
+                offset = 0;
+                break;
+            default:
+                insn.offset = offset;
+                break;
+            }
+            instructions[out++] = insn;
+        }
+        out = append_move(instructions, out, offset);
+        instructions.resize(out);
+    }
+    size_t append_move(ArenaArray<Instruction> &instructions, size_t out,
+                       long long offset) {
+        if (offset > 0) {
+            instructions[out++] = Instruction::right(offset);
+        } else if (offset < 0) {
+            instructions[out++] = Instruction::left(-offset);
+        }
+        return out;
+    }
+    /**
+     * Appends a Set, dropping arithmetic on the cell that it overwrites.
+     */
+    void append_set(Program &program, int value) {
+        auto &instructions = program.instructions;
+        while (!instructions.empty()) {
+            auto type = instructions.back().type;
+            if (type != Instruction::Type::Add &&
+                type != Instruction::Type::Sub &&
+                type != Instruction::Type::Set) {
+                break;
+            }
+            instructions.pop_back();
+        }
+        program.append(Instruction::set(value));
+    }
+    /**
+     * Appends an instruction, folding Add/Sub into a preceding Set.
+     */
+    void append_folded(Program &program, Instruction insn) {
+        auto &instructions = program.instructions;
+        if (!instructions.empty() &&
+            instructions.back().type == Instruction::Type::Set) {
+            Instruction &set = instructions.back();
+            if (insn.type == Instruction::Type::Add) {
+                set.value += insn.value;
+                return;
+            }
+            if (insn.type == Instruction::Type::Sub) {
+                set.value -= insn.value;
+                return;
+            }
+        }
+        if (insn.type == Instruction::Type::Set) {
+            append_set(program, insn.value);
+            return;
+        }
+        program.append(insn);
+    }
+
+    int cell_bits{8};
+};
+
+struct JitCompiler {
+
+    JitCompiler() {}
+    explicit JitCompiler(const Options &options) : insn_compiler(options) {}
+    JitCompiler(const Options &options, bool use_avx2)
+        : insn_compiler(options, use_avx2) {}
+
+    /**
+     * Generates the program straight into the buffer it will run from.
+     * Returns an empty Function if the code could not be installed.
+     */
+    JIT::Function compile(Program &program) {
+        return generate(program).make_executable();
+    }
+    /**
+     * Generates the program without installing it, e.g. to write it out.
+     */
+    JIT::CodeBuffer generate(Program &program) {
+        emitter = JIT::Emitter();
+        insn_compiler.compile_setup(emitter);
+        generate_code(program);
+        insn_compiler.compile_cleanup(emitter);
+        emitter.resolve_labels();
+        return std::move(emitter.code());
+    }
+    /**
+     * Generates a function that runs fragment, a single loop, from the tape
+     * pointer it is given and returns the tape pointer it stops at.
+     */
+    JIT::Function compile_loop(Program &fragment) {
+        emitter = JIT::Emitter();
+        insn_compiler.compile_setup(emitter);
+        generate_code(fragment);
+        insn_compiler.compile_return_head(emitter);
+        emitter.resolve_labels();
+        return emitter.code().make_executable();
+    }
+
+  private:
+    struct LoopLabels {
+        JIT::Label body;
+        JIT::Label end;
+    };
+
+    void generate_code(Program &program) {
+        Instruction previous = Instruction::loop();
+        JIT::Label skip;
+        for (auto &insn : program.instructions) {
+            // A run of MulAdds from the same cell shares one load of it
+            bool run = previous.type == Instruction::Type::MulAdd;
+            bool continued = run && insn.type == Instruction::Type::MulAdd &&
+                             previous.offset == insn.offset;
+            if (run && !continued) {
+                emitter.bind(skip);
+            }
+            if (insn.type == Instruction::Type::MulAdd && !continued) {
+                skip = emitter.new_label();
+                insn_compiler.compile_load_factor(insn, skip, emitter);
+            }
+            process_instruction(insn);
+            previous = insn;
+        }
+        if (previous.type == Instruction::Type::MulAdd) {
+            emitter.bind(skip);
+        }
+    }
+
+    void process_instruction(Instruction insn) {
+        switch (insn.type) {
+        case Instruction::Type::Add: {
+            insn_compiler.compile_add(insn, emitter);
+            break;
+        }
+        case Instruction::Type::Sub: {
+            insn_compiler.compile_sub(insn, emitter);
+            break;
+        }
+        case Instruction::Type::Right: {
+            insn_compiler.compile_right(insn, emitter);
+            break;
+        }
+        case Instruction::Type::Left: {
+            insn_compiler.compile_left(insn, emitter);
+            break;
+        }
+        case Instruction::Type::Set: {
+            insn_compiler.compile_set(insn, emitter);
+            break;
+        }
+        case Instruction::Type::MulAdd: {
+            insn_compiler.compile_mul_add(insn, emitter);
+            break;
+        }
+        case Instruction::Type::Scan: {
+            insn_compiler.compile_scan(insn, emitter);
+            break;
+        }
+        case Instruction::Type::Read: {
+            insn_compiler.compile_read(insn, emitter);
+            break;
+        }
+        case Instruction::Type::Write: {
+            insn_compiler.compile_write(insn, emitter);
+            break;
+        }
+        case Instruction::Type::Loop: {
+            LoopLabels labels{emitter.new_label(), emitter.new_label()};
+            insn_compiler.compile_loop(labels.body, labels.end, emitter);
+            loops.push_back(labels);
+            break;
+        }
+        case Instruction::Type::EndLoop: {
+            LoopLabels labels = loops.back();
+            loops.pop_back();
+            insn_compiler.compile_end_loop(labels.body, labels.end, emitter);
+            break;
+        }
+        }
+    }
+    JIT::Emitter emitter;
+    std::vector<LoopLabels> loops;
+    JIT::Compiler insn_compiler;
+};
+
+bool write_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+/**
+ * Streaming 64-bit hash. The input is consumed 8 bytes at a time with a
+ * multiply-rotate round, independently of how it is split into updates.
+ */
+struct Hasher {
+    void update(const char *data, size_t size) {
+        length += size;
+        while (size > 0 && pending_size != 0) {
+            pending |= (unsigned long long)(unsigned char)*data++
+                       << (8 * pending_size++);
+            size--;
+            if (pending_size == 8) {
+                mix(pending);
+                pending = 0;
+                pending_size = 0;
+            }
+        }
+        for (; size >= 8; data += 8, size -= 8) {
+            unsigned long long word;
+            memcpy(&word, data, 8);
+            mix(word);
+        }
+        for (; size > 0; size--) {
+            pending |= (unsigned long long)(unsigned char)*data++
+                       << (8 * pending_size++);
+        }
+    }
+    unsigned long long digest() {
+        unsigned long long h = state ^ pending ^ length;
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDull;
+        h ^= h >> 33;
+        h *= 0xC4CEB9FE1A85EC53ull;
+        h ^= h >> 33;
+        return h;
+    }
+
+  private:
+    void mix(unsigned long long word) {
+        state = (state ^ word) * 0x9E3779B97F4A7C15ull;
+        state = (state << 27 | state >> 37) * 0xBF58476D1CE4E5B9ull;
+    }
+
+    unsigned long long state{0x243F6A8885A308D3ull};
+    unsigned long long pending{0};
+    size_t pending_size{0};
+    unsigned long long length{0};
+};
+
+/**
+ * The commands in source with the comments left out
+ */
+std::string filter_commands(const char *source, size_t length) {
+    // The filter may store up to 16 bytes past the commands it finds
+    std::string commands(length + 16, '\0');
+    size_t count = 0;
+    for (size_t start = 0; start < length; start += Compiler::chunk_size) {
+        count += CommandFilter::filter(
+            source + start, std::min(Compiler::chunk_size, length - start),
+            &commands[count]);
+    }
+    commands.resize(count);
+    return commands;
+}
+
+/**
+ * Hashes the GNU build ID of the loaded object that contains address
+ */
+struct BuildIdSearch {
+    explicit BuildIdSearch(ElfW(Addr) address) : address(address) {}
+
+    static int visit(struct dl_phdr_info *info, size_t, void *data) {
+        BuildIdSearch &search = *(BuildIdSearch *)data;
+        if (!search.contains(info)) {
+            return 0;
+        }
+        for (int i = 0; i < info->dlpi_phnum; i++) {
+            const ElfW(Phdr) &phdr = info->dlpi_phdr[i];
+            if (phdr.p_type == PT_NOTE) {
+                search.read_notes(
+                    (const char *)(info->dlpi_addr + phdr.p_vaddr),
+                    phdr.p_memsz);
+            }
+        }
+        return 1;
+    }
+
+    Hasher hasher;
+    bool found{false};
+
+  private:
+    bool contains(struct dl_phdr_info *info) {
+        for (int i = 0; i < info->dlpi_phnum; i++) {
+            const ElfW(Phdr) &phdr = info->dlpi_phdr[i];
+            ElfW(Addr) start = info->dlpi_addr + phdr.p_vaddr;
+            if (phdr.p_type == PT_LOAD && address >= start &&
+                address < start + phdr.p_memsz) {
+                return true;
+            }
+        }
+        return false;
+    }
+    void read_notes(const char *note, size_t size) {
+        const char *end = note + size;
+        while (!found && note + sizeof(ElfW(Nhdr)) <= end) {
+            const ElfW(Nhdr) &header = *(const ElfW(Nhdr) *)note;
+            const char *name = note + sizeof(ElfW(Nhdr));
+            const char *description = name + (header.n_namesz + 3) / 4 * 4;
+            if (header.n_type == NT_GNU_BUILD_ID && header.n_namesz == 4 &&
+                memcmp(name, "GNU", 4) == 0) {
+                hasher.update(description, header.n_descsz);
+                found = true;
+            }
+            note = description + (header.n_descsz + 3) / 4 * 4;
+        }
+    }
+
+    ElfW(Addr) address;
+};
+
+/**
+ * Hash identifying the binary the library was linked into, taken from the
+ * build ID the linker writes. Without one it falls back to when this file
+ * was compiled.
+ */
+unsigned long long build_identity() {
+    static const unsigned long long identity = [] {
+        BuildIdSearch search((ElfW(Addr))&build_identity);
+        dl_iterate_phdr(BuildIdSearch::visit, &search);
+        if (!search.found) {
+            static const char compiled[] = __DATE__ " " __TIME__;
+            search.hasher.update(compiled, sizeof(compiled));
+        }
+        return search.hasher.digest();
+    }();
+    return identity;
+}
+
+/**
+ * On-disk cache of JIT output. The generated code is position independent,
+ * so an entry is just a header followed by the code at a page-aligned
+ * offset, and a hit maps the code straight from the file. Entries are
+ * named after a hash of the program's commands and of everything that
+ * changes the code: the options, the vector extension used, the build of
+ * the library and the format version. The commands are stored after the
+ * header and compared on every hit, since the name is only a hash. Any
+ * problem with the cache just means compiling normally.
+ */
+struct CodeCache {
+    static const unsigned int version = 4;
+
+    CodeCache(const Options &options, std::string commands)
+        : commands(std::move(commands)) {
+        expected.version = version;
+        expected.eof = (unsigned char)options.eof;
+        expected.cell_bits = options.cell_bits;
+        expected.avx2 = JIT::Compiler::supports_avx2();
+        expected.build = build_identity();
+        expected.commands_size = this->commands.size();
+        Hasher hasher;
+        hasher.update((const char *)&expected, sizeof(expected));
+        hasher.update(this->commands.data(), this->commands.size());
+        char name[32];
+        snprintf(name, sizeof(name), "/%016llx.bfc", hasher.digest());
+        path = options.cache_directory + name;
+    }
+
+    /**
+     * Maps the cached code, or returns an empty Function on a miss.
+     */
+    JIT::Function load() {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return JIT::Function();
+        }
+        Header header;
+        struct stat info;
+        size_t page_size = sysconf(_SC_PAGESIZE);
+        void *code = MAP_FAILED;
+        if (pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+            fstat(fd, &info) == 0 && matches(header) &&
+            header.code_offset % page_size == 0 && header.code_size > 0 &&
+            header.code_offset >= sizeof(header) + commands.size() &&
+            header.code_offset + header.code_size <= (size_t)info.st_size &&
+            matches_commands(fd)) {
+            code = mmap(0, header.code_size, PROT_READ | PROT_EXEC,
+                        MAP_PRIVATE, fd, header.code_offset);
+        }
+        close(fd);
+        if (code == MAP_FAILED) {
+            return JIT::Function();
+        }
+        return JIT::Function((char *)code, header.code_size,
+                             header.code_size);
+    }
+    /**
+     * Writes function to the cache. The entry is written to a temporary
+     * file and renamed into place, so readers never see a partial entry.
+     */
+    void store(JIT::Function &function) {
+        mkdir(path.substr(0, path.rfind('/')).c_str(), 0755);
+        std::string temporary = path + "." + std::to_string(getpid());
+        int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd < 0) {
+            return;
+        }
+        Header header = expected;
+        size_t page_size = sysconf(_SC_PAGESIZE);
+        header.code_offset = (sizeof(header) + commands.size() + page_size -
+                              1) / page_size * page_size;
+        header.code_size = function.size();
+        std::vector<char> prefix(header.code_offset, 0);
+        memcpy(prefix.data(), &header, sizeof(header));
+        memcpy(prefix.data() + sizeof(header), commands.data(),
+               commands.size());
+        bool written = write_all(fd, prefix.data(), prefix.size()) &&
+                       write_all(fd, function.data(), function.size());
+        close(fd);
+        if (!written || rename(temporary.c_str(), path.c_str()) < 0) {
+            unlink(temporary.c_str());
+        }
+    }
+
+  private:
+    struct Header {
+        char magic[8]{'b', 'f', 'j', 'i', 't', 'c', 'o', 'd'};
+        unsigned int version{0};
+        unsigned char eof{0};
+        unsigned char avx2{0};
+        unsigned short cell_bits{0};
+        // Identity of the build that generated the code
+        unsigned long long build{0};
+        // Length of the commands that follow the header
+        unsigned long long commands_size{0};
+        unsigned long long code_offset{0};
+        unsigned long long code_size{0};
+    };
+
+    bool matches(const Header &header) {
+        return memcmp(header.magic, expected.magic, sizeof(header.magic)) ==
+                   0 &&
+               header.version == expected.version &&
+               header.eof == expected.eof && header.avx2 == expected.avx2 &&
+               header.cell_bits == expected.cell_bits &&
+               header.build == expected.build &&
+               header.commands_size == expected.commands_size;
+    }
+    bool matches_commands(int fd) {
+        std::string stored(commands.size(), '\0');
+        return pread(fd, &stored[0], stored.size(), sizeof(Header)) ==
+                   (ssize_t)stored.size() &&
+               stored == commands;
+    }
+    Header expected;
+    std::string commands;
+    std::string path;
+};
+
+/**
+ * ELF header of the given type for x86-64 Linux, with everything but the
+ * program and section header tables filled in
+ */
+Elf64_Ehdr elf_header(unsigned type) {
+    Elf64_Ehdr header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.e_ident, ELFMAG, SELFMAG);
+    header.e_ident[EI_CLASS] = ELFCLASS64;
+    header.e_ident[EI_DATA] = ELFDATA2LSB;
+    header.e_ident[EI_VERSION] = EV_CURRENT;
+    header.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    header.e_type = type;
+    header.e_machine = EM_X86_64;
+    header.e_version = EV_CURRENT;
+    header.e_ehsize = sizeof(Elf64_Ehdr);
+    return header;
+}
+
+/**
+ * Writes generated code as a static x86-64 Linux executable that needs
+ * neither libc nor the compiler at run time. The file has three segments:
+ *
+ * - text: the headers, an entry stub, flush/fill hooks doing raw read and
+ *   write syscalls, then the generated code, which is position independent
+ * - data: the Runtime, pointing at the hooks, followed by the I/O buffers
+ * - tape: zero-filled cells after an unmapped gap as wide as the guards of
+ *   Tape, so no access left of the first cell can reach the data segment
+ *
+ * Moving off the tape hits unmapped memory and kills the process with
+ * SIGSEGV.
+ */
+struct ExecutableWriter {
+    static constexpr unsigned long long text_address = 0x400000;
+    static const size_t page_size = 0x1000;
+    static const size_t buffer_size = 1 << 16;
+    static constexpr size_t tape_size = 1ull << 30;
+
+    bool write(JIT::CodeBuffer &code, const std::string &path,
+               std::string &error) {
+        JIT::Emitter stubs;
+        Stubs offsets = emit_stubs(stubs);
+        if (stubs.code().failed()) {
+            error = "Could not generate code for the program";
+            return false;
+        }
+        size_t headers_size = sizeof(Elf64_Ehdr) + 4 * sizeof(Elf64_Phdr);
+        size_t text_size = headers_size + stubs.length() + code.size();
+        unsigned long long stubs_address = text_address + headers_size;
+
+        size_t data_offset = align(text_size);
+        unsigned long long data_address = text_address + data_offset;
+        unsigned long long out_buffer = data_address + page_size;
+        unsigned long long in_buffer = out_buffer + buffer_size;
+        size_t data_size = page_size + 2 * buffer_size;
+        unsigned long long tape_address =
+            data_address + align(data_size) +
+            align((size_t)Instruction::max_reach * 8);
+
+        Runtime runtime;
+        memset(&runtime, 0, sizeof(runtime));
+        runtime.out_buffer = (char *)out_buffer;
+        runtime.out_cursor = runtime.out_buffer;
+        runtime.out_end = runtime.out_buffer + buffer_size;
+        runtime.in_buffer = (char *)in_buffer;
+        runtime.in_cursor = runtime.in_buffer;
+        runtime.in_end = runtime.in_buffer;
+        runtime.flush = (int (*)(Runtime *))(stubs_address + offsets.flush);
+        runtime.fill = (int (*)(Runtime *))(stubs_address + offsets.fill);
+        stubs.code().patch(offsets.tape, tape_address, 8);
+        stubs.code().patch(offsets.runtime, data_address, 8);
+
+        Elf64_Ehdr header = elf_header(ET_EXEC);
+        header.e_entry = stubs_address + offsets.start;
+        header.e_phoff = sizeof(Elf64_Ehdr);
+        header.e_phentsize = sizeof(Elf64_Phdr);
+        header.e_phnum = 4;
+        Elf64_Phdr segments[4] = {
+            segment(PT_LOAD, PF_R | PF_X, 0, text_address, text_size,
+                    text_size),
+            segment(PT_LOAD, PF_R | PF_W, data_offset, data_address,
+                    sizeof(runtime), data_size),
+            segment(PT_LOAD, PF_R | PF_W, 0, tape_address, 0, tape_size),
+            // Keeps the stack non-executable
+            segment(PT_GNU_STACK, PF_R | PF_W, 0, 0, 0, 0),
+        };
+
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0755);
+        if (fd < 0) {
+            error = "Could not create " + path + ": " + strerror(errno);
+            return false;
+        }
+        std::vector<char> padding(data_offset - text_size, 0);
+        bool written =
+            write_all(fd, (const char *)&header, sizeof(header)) &&
+            write_all(fd, (const char *)segments, sizeof(segments)) &&
+            write_all(fd, stubs.code().data(), stubs.length()) &&
+            write_all(fd, code.data(), code.size()) &&
+            write_all(fd, padding.data(), padding.size()) &&
+            write_all(fd, (const char *)&runtime, sizeof(runtime));
+        close(fd);
+        if (!written) {
+            error = "Could not write " + path + ": " + strerror(errno);
+            return false;
+        }
+        return true;
+    }
+
+  private:
+    /**
+     * Where the entry points of the stubs and the address slots of the
+     * entry stub are, relative to the start of the stubs.
+     */
+    struct Stubs {
+        size_t start;
+        size_t flush;
+        size_t fill;
+        size_t tape;
+        size_t runtime;
+    };
+
+    /**
+     * Emits the entry stub and the hooks. The generated code is appended
+     * right after them, which is where the entry stub calls.
+     */
+    Stubs emit_stubs(JIT::Emitter &emitter) {
+        using namespace JIT;
+        Stubs offsets;
+        Label code = emitter.new_label();
+        Label flush = emitter.new_label();
+
+        offsets.start = emitter.length();
+        emitter.mov(Register64::RDI, Imm64(0));
+        offsets.tape = emitter.length() - 8;
+        emitter.mov(Register64::RSI, Imm64(0));
+        offsets.runtime = emitter.length() - 8;
+        emitter.call(code);
+        emitter.mov(Register32::EDI, Register32::EAX);
+        emitter.mov(Register32::EAX, Imm32(SYS_exit_group));
+        emitter.syscall();
+
+        // Writes out_buffer up to out_cursor. Runs until everything is
+        // written or write fails, in which case the rest is dropped.
+        offsets.flush = emitter.length();
+        emitter.bind(flush);
+        Label write_more = emitter.new_label();
+        Label flushed = emitter.new_label();
+        emitter.push(Register64::RBP);
+        emitter.mov(Register64::RBP, Register64::RDI);
+        emitter.mov_deref(Register64::RSI, Register64::RBP,
+                          offsetof(Runtime, out_buffer));
+        emitter.bind(write_more);
+        emitter.mov_deref(Register64::RDX, Register64::RBP,
+                          offsetof(Runtime, out_cursor));
+        emitter.sub(Register64::RDX, Register64::RSI);
+        emitter.jle_short(flushed);
+        emitter.mov(Register32::EDI, Imm32(1));
+        emitter.mov(Register32::EAX, Imm32(SYS_write));
+        emitter.syscall();
+        emitter.test(Register64::RAX, Register64::RAX);
+        emitter.jle_short(flushed);
+        emitter.add(Register64::RSI, Register64::RAX);
+        emitter.jmp_short(write_more);
+        emitter.bind(flushed);
+        emitter.mov_deref(Register64::RAX, Register64::RBP,
+                          offsetof(Runtime, out_buffer));
+        emitter.deref_mov(Register64::RBP, Register64::RAX,
+                          offsetof(Runtime, out_cursor));
+        emitter.mov(Register32::EAX, Imm32(0));
+        emitter.pop(Register64::RBP);
+        emitter.ret();
+
+        // Flushes, then reads whatever stdin has into in_buffer. Errors
+        // count as end of input.
+        offsets.fill = emitter.length();
+        Label got_input = emitter.new_label();
+        emitter.push(Register64::RBP);
+        emitter.mov(Register64::RBP, Register64::RDI);
+        emitter.call(flush);
+        emitter.mov(Register32::EDI, Imm32(0));
+        emitter.mov_deref(Register64::RSI, Register64::RBP,
+                          offsetof(Runtime, in_buffer));
+        emitter.mov(Register32::EDX, Imm32(buffer_size));
+        emitter.mov(Register32::EAX, Imm32(SYS_read));
+        emitter.syscall();
+        emitter.test(Register64::RAX, Register64::RAX);
+        emitter.jg_short(got_input);
+        emitter.mov(Register32::EAX, Imm32(0));
+        emitter.bind(got_input);
+        emitter.deref_mov(Register64::RBP, Register64::RSI,
+                          offsetof(Runtime, in_cursor));
+        emitter.add(Register64::RSI, Register64::RAX);
+        emitter.deref_mov(Register64::RBP, Register64::RSI,
+                          offsetof(Runtime, in_end));
+        emitter.pop(Register64::RBP);
+        emitter.ret();
+
+        emitter.bind(code);
+        emitter.resolve_labels();
+        return offsets;
+    }
+    static Elf64_Phdr segment(unsigned type, unsigned flags, size_t offset,
+                              unsigned long long address, size_t file_size,
+                              size_t memory_size) {
+        Elf64_Phdr phdr;
+        phdr.p_type = type;
+        phdr.p_flags = flags;
+        phdr.p_offset = offset;
+        phdr.p_vaddr = address;
+        phdr.p_paddr = address;
+        phdr.p_filesz = file_size;
+        phdr.p_memsz = memory_size;
+        phdr.p_align = type == PT_LOAD ? page_size : 16;
+        return phdr;
+    }
+    static size_t align(size_t size) {
+        return (size + page_size - 1) / page_size * page_size;
+    }
+};
+
+/**
+ * Writes generated code as an x86-64 ELF relocatable object, so programs
+ * can be linked into other executables without the compiler. The object
+ * defines `int bf_<name>(char *tape)`, which runs the program on tape, and
+ * leaves two I/O functions to be defined by whoever links it:
+ *
+ *     void bf_write(const char *data, size_t size);
+ *     size_t bf_read(char *buffer, size_t capacity);
+ *
+ * bf_read returns how many bytes it stored, 0 meaning end of input.
+ */
+struct ObjectWriter {
+    // The entry function keeps the Runtime and both buffers on the stack,
+    // and with these sizes its frame stays within a page, so it cannot skip
+    // over a stack guard page
+    static const size_t buffer_size = 1 << 10;
+    static const size_t runtime_size = (sizeof(Runtime) + 15) / 16 * 16;
+    static const size_t frame_size = runtime_size + 2 * buffer_size + 8;
+
+    enum Section {
+        Null,
+        Text,
+        RelaText,
+        Symbols,
+        Strings,
+        NoteStack,
+        SectionNames,
+        SectionCount,
+    };
+    enum Symbol {
+        NoSymbol,
+        Entry,
+        Write,
+        Read,
+    };
+
+    bool write(JIT::CodeBuffer &code, const std::string &name,
+               const std::string &path, std::string &error) {
+        JIT::Emitter stubs;
+        std::vector<Elf64_Rela> relocations;
+        emit_stubs(stubs, relocations);
+        if (stubs.code().failed()) {
+            error = "Could not generate code for the program";
+            return false;
+        }
+        std::vector<char> text(stubs.code().data(),
+                               stubs.code().data() + stubs.length());
+        text.insert(text.end(), code.data(), code.data() + code.size());
+
+        std::string strings = std::string("\0bf_", 4) + name + '\0' +
+                              "bf_write" + '\0' + "bf_read" + '\0';
+        size_t write_name = name.size() + 5;
+        size_t read_name = write_name + sizeof("bf_write");
+        Elf64_Sym symbols[4];
+        memset(symbols, 0, sizeof(symbols));
+        symbols[Entry].st_name = 1;
+        symbols[Entry].st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+        symbols[Entry].st_shndx = Text;
+        // The program is part of the function, so profilers attribute the
+        // time spent in it to bf_<name>
+        symbols[Entry].st_size = text.size();
+        symbols[Write].st_name = write_name;
+        symbols[Write].st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+        symbols[Read].st_name = read_name;
+        symbols[Read].st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+
+        const char section_names[] =
+            "\0.text\0.rela.text\0.symtab\0.strtab\0.note.GNU-stack\0"
+            ".shstrtab";
+
+        std::vector<char> file(sizeof(Elf64_Ehdr));
+        Elf64_Shdr sections[SectionCount];
+        memset(sections, 0, sizeof(sections));
+        sections[Text] = section(1, SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR,
+                                 append(file, text.data(), text.size(), 16),
+                                 text.size(), 16);
+        sections[RelaText] =
+            section(7, SHT_RELA, SHF_INFO_LINK,
+                    append(file, relocations.data(),
+                           relocations.size() * sizeof(Elf64_Rela), 8),
+                    relocations.size() * sizeof(Elf64_Rela), 8);
+        sections[RelaText].sh_link = Symbols;
+        sections[RelaText].sh_info = Text;
+        sections[RelaText].sh_entsize = sizeof(Elf64_Rela);
+        sections[Symbols] =
+            section(18, SHT_SYMTAB, 0,
+                    append(file, symbols, sizeof(symbols), 8),
+                    sizeof(symbols), 8);
+        sections[Symbols].sh_link = Strings;
+        // Index of the first global symbol
+        sections[Symbols].sh_info = Entry;
+        sections[Symbols].sh_entsize = sizeof(Elf64_Sym);
+        sections[Strings] =
+            section(26, SHT_STRTAB, 0,
+                    append(file, strings.data(), strings.size(), 1),
+                    strings.size(), 1);
+        // Marks the stack as non-executable for the linker
+        sections[NoteStack] = section(34, SHT_PROGBITS, 0, file.size(), 0, 1);
+        sections[SectionNames] =
+            section(50, SHT_STRTAB, 0,
+                    append(file, section_names, sizeof(section_names), 1),
+                    sizeof(section_names), 1);
+        size_t section_offset = append(file, sections, sizeof(sections), 8);
+
+        Elf64_Ehdr header = elf_header(ET_REL);
+        header.e_shoff = section_offset;
+        header.e_shentsize = sizeof(Elf64_Shdr);
+        header.e_shnum = SectionCount;
+        header.e_shstrndx = SectionNames;
+        memcpy(file.data(), &header, sizeof(header));
+
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            error = "Could not create " + path + ": " + strerror(errno);
+            return false;
+        }
+        bool written = write_all(fd, file.data(), file.size());
+        close(fd);
+        if (!written) {
+            error = "Could not write " + path + ": " + strerror(errno);
+            return false;
+        }
+        return true;
+    }
+
+  private:
+    /**
+     * Emits the entry function and the Runtime hooks, which forward to
+     * bf_write and bf_read. The generated code is appended right after
+     * them, which is where the entry function calls.
+     */
+    void emit_stubs(JIT::Emitter &emitter,
+                    std::vector<Elf64_Rela> &relocations) {
+        using namespace JIT;
+        Label code = emitter.new_label();
+        Label flush = emitter.new_label();
+        Label fill = emitter.new_label();
+
+        // The tape is already in RDI, where the generated code expects it.
+        // Entered with RSP 8 bytes off alignment, which the odd frame size
+        // makes up for.
+        emitter.sub(Register64::RSP, Imm32(frame_size));
+        emitter.mov(Register64::RSI, Register64::RSP);
+        emitter.mov(Register64::RAX, Register64::RSI);
+        emitter.add(Register64::RAX, Imm32(runtime_size));
+        emitter.deref_mov(Register64::RSI, Register64::RAX,
+                          offsetof(Runtime, out_buffer));
+        emitter.deref_mov(Register64::RSI, Register64::RAX,
+                          offsetof(Runtime, out_cursor));
+        emitter.add(Register64::RAX, Imm32(buffer_size));
+        emitter.deref_mov(Register64::RSI, Register64::RAX,
+                          offsetof(Runtime, out_end));
+        emitter.deref_mov(Register64::RSI, Register64::RAX,
+                          offsetof(Runtime, in_buffer));
+        emitter.deref_mov(Register64::RSI, Register64::RAX,
+                          offsetof(Runtime, in_cursor));
+        emitter.deref_mov(Register64::RSI, Register64::RAX,
+                          offsetof(Runtime, in_end));
+        emitter.lea(Register64::RAX, flush);
+        emitter.deref_mov(Register64::RSI, Register64::RAX,
+                          offsetof(Runtime, flush));
+        emitter.lea(Register64::RAX, fill);
+        emitter.deref_mov(Register64::RSI, Register64::RAX,
+                          offsetof(Runtime, fill));
+        emitter.call(code);
+        emitter.add(Register64::RSP, Imm32(frame_size));
+        emitter.ret();
+
+        // Hands out_buffer up to out_cursor to bf_write
+        emitter.bind(flush);
+        emitter.push(Register64::RBP);
+        emitter.mov(Register64::RBP, Register64::RDI);
+        emitter.mov_deref(Register64::RDI, Register64::RBP,
+                          offsetof(Runtime, out_buffer));
+        emitter.mov_deref(Register64::RSI, Register64::RBP,
+                          offsetof(Runtime, out_cursor));
+        emitter.sub(Register64::RSI, Register64::RDI);
+        call_external(Write, emitter, relocations);
+        emitter.mov_deref(Register64::RAX, Register64::RBP,
+                          offsetof(Runtime, out_buffer));
+        emitter.deref_mov(Register64::RBP, Register64::RAX,
+                          offsetof(Runtime, out_cursor));
+        emitter.mov(Register32::EAX, Imm32(0));
+        emitter.pop(Register64::RBP);
+        emitter.ret();
+
+        // Flushes, then refills in_buffer from bf_read
+        emitter.bind(fill);
+        emitter.push(Register64::RBP);
+        emitter.mov(Register64::RBP, Register64::RDI);
+        emitter.call(flush);
+        emitter.mov_deref(Register64::RDI, Register64::RBP,
+                          offsetof(Runtime, in_buffer));
+        emitter.mov(Register32::ESI, Imm32(buffer_size));
+        call_external(Read, emitter, relocations);
+        emitter.mov_deref(Register64::RSI, Register64::RBP,
+                          offsetof(Runtime, in_buffer));
+        emitter.deref_mov(Register64::RBP, Register64::RSI,
+                          offsetof(Runtime, in_cursor));
+        emitter.add(Register64::RSI, Register64::RAX);
+        emitter.deref_mov(Register64::RBP, Register64::RSI,
+                          offsetof(Runtime, in_end));
+        emitter.pop(Register64::RBP);
+        emitter.ret();
+
+        emitter.bind(code);
+        emitter.resolve_labels();
+    }
+    /**
+     * Calls symbol through a relocation for the linker to fill in
+     */
+    static void call_external(Symbol symbol, JIT::Emitter &emitter,
+                              std::vector<Elf64_Rela> &relocations) {
+        emitter.call(JIT::Imm32(0));
+        Elf64_Rela relocation;
+        relocation.r_offset = emitter.length() - 4;
+        relocation.r_info = ELF64_R_INFO(symbol, R_X86_64_PLT32);
+        // The displacement is relative to the end of the instruction
+        relocation.r_addend = -4;
+        relocations.push_back(relocation);
+    }
+    /**
+     * Appends size bytes at an offset aligned to alignment and returns
+     * that offset
+     */
+    static size_t append(std::vector<char> &file, const void *data,
+                         size_t size, size_t alignment) {
+        file.resize((file.size() + alignment - 1) / alignment * alignment);
+        size_t offset = file.size();
+        file.insert(file.end(), (const char *)data, (const char *)data + size);
+        return offset;
+    }
+    static Elf64_Shdr section(unsigned name, unsigned type,
+                              unsigned long long flags, size_t offset,
+                              size_t size, size_t alignment) {
+        Elf64_Shdr shdr;
+        memset(&shdr, 0, sizeof(shdr));
+        shdr.sh_name = name;
+        shdr.sh_type = type;
+        shdr.sh_flags = flags;
+        shdr.sh_offset = offset;
+        shdr.sh_size = size;
+        shdr.sh_addralign = alignment;
+        return shdr;
+    }
+};
+
+/**
+ * Portable backend over the optimized IR. The program is translated to
+ * threaded code: every operation carries the address of its handler and
+ * each handler jumps straight to the next one with computed goto, so there
+ * is no central dispatch switch to mispredict.
+ */
+struct ThreadedInterpreter {
+    ThreadedInterpreter() {}
+    /**
+     * Translates program once; the result can be run any number of times.
+     */
+    ThreadedInterpreter(Program &program, const Options &options)
+        : options(options) {
+        translate(program, dispatch(nullptr, nullptr, nullptr));
+    }
+
+    int run(char *tape, Runtime *runtime) const {
+        dispatch(ops.data(), tape, runtime);
+        return 0;
+    }
+    size_t size() const { return ops.size() * sizeof(Op); }
+
+  private:
+    struct Op {
+        const void *handler;
+        // Loop and EndLoop keep the index of the op to jump to in value
+        Instruction insn;
+    };
+
+    /**
+     * Runs ops with the handlers for the cell width and returns the handler
+     * table, which only exists inside execute.
+     */
+    const void *const *dispatch(const Op *ops, char *tape,
+                                Runtime *runtime) const {
+        switch (options.cell_bits) {
+        case 16:
+            return execute<unsigned short>(ops, tape, runtime);
+        case 32:
+            return execute<unsigned int>(ops, tape, runtime);
+        case 64:
+            return execute<unsigned long long>(ops, tape, runtime);
+        default:
+            return execute<unsigned char>(ops, tape, runtime);
+        }
+    }
+
+    /**
+     * Runs ops to completion, or only returns the handler table when ops is
+     * nullptr.
+     */
+    template <typename Cell>
+    const void *const *execute(const Op *op, char *tape,
+                               Runtime *runtime) const {
+        // Indexed by Instruction::Type, followed by the final halt
+        static const void *const handlers[] = {
+            &&add,   &&sub,  &&right, &&left,    &&loop, &&end_loop,
+            &&write, &&read, &&set,   &&mul_add, &&scan, &&halt,
+        };
+        if (op == nullptr) {
+            return handlers;
+        }
+        const Op *ops = op;
+        Cell *head = (Cell *)tape;
+        goto *op->handler;
+
+    add:
+        head[op->insn.offset] += op->insn.value;
+        goto *(++op)->handler;
+    sub:
+        head[op->insn.offset] -= op->insn.value;
+        goto *(++op)->handler;
+    right:
+        head += op->insn.value;
+        goto *(++op)->handler;
+    left:
+        head -= op->insn.value;
+        goto *(++op)->handler;
+    loop:
+        if (*head == 0) {
+            op = &ops[op->insn.value];
+            goto *op->handler;
+        }
+        goto *(++op)->handler;
+    end_loop:
+        if (*head != 0) {
+            op = &ops[op->insn.value];
+            goto *op->handler;
+        }
+        goto *(++op)->handler;
+    write:
+        *runtime->out_cursor++ = head[op->insn.offset];
+        if (runtime->out_cursor >= runtime->out_end) {
+            runtime->flush(runtime);
+        }
+        goto *(++op)->handler;
+    read:
+        if (runtime->in_cursor >= runtime->in_end) {
+            runtime->fill(runtime);
+        }
+        if (runtime->in_cursor < runtime->in_end) {
+            head[op->insn.offset] = (unsigned char)*runtime->in_cursor++;
+        } else if (options.eof == EofPolicy::Zero) {
+            head[op->insn.offset] = 0;
+        } else if (options.eof == EofPolicy::MinusOne) {
+            head[op->insn.offset] = (Cell)-1;
+        }
+        goto *(++op)->handler;
+    set:
+        head[op->insn.offset] = (Cell)op->insn.value;
+        goto *(++op)->handler;
+    mul_add:
+        // Skipped on zero like the loop it replaces, which may not have
+        // been allowed to reach the target
+        if (head[op->insn.offset] != 0) {
+            head[op->insn.target()] += (Cell)(op->insn.mul.factor *
+                                              head[op->insn.offset]);
+        }
+        goto *(++op)->handler;
+    scan:
+        while (*head != 0) {
+            head += op->insn.value;
+        }
+        goto *(++op)->handler;
+    halt:
+        runtime->flush(runtime);
+        return handlers;
+    }
+
+    /**
+     * Pairs every instruction with its handler, resolves the loop jumps
+     * and terminates the code with halt.
+     */
+    void translate(Program &program, const void *const *handlers) {
+        std::vector<size_t> loops;
+        ops.reserve(program.instructions.size() + 1);
+        for (auto &insn : program.instructions) {
+            Op op{handlers[(int)insn.type], insn};
+            if (insn.type == Instruction::Type::Loop) {
+                loops.push_back(ops.size());
+            } else if (insn.type == Instruction::Type::EndLoop) {
+                size_t begin = loops.back();
+                loops.pop_back();
+                ops[begin].insn.value = ops.size() + 1;
+                op.insn.value = begin + 1;
+            }
+            ops.push_back(op);
+        }
+        const void *halt = handlers[(int)Instruction::Type::Scan + 1];
+        ops.push_back(Op{halt, Instruction::end_loop()});
+    }
+
+    Options options;
+    std::vector<Op> ops;
+};
+
+/**
+ * Backend that starts running right away and compiles only what turns out
+ * to be hot. The IR is interpreted directly, counting the iterations of
+ * every loop, and a loop that reaches hot_loop iterations is handed to the
+ * JIT on its own. From then on entering it runs the machine code, which
+ * returns the tape pointer where the loop stopped. Short programs never
+ * wait for the JIT and long ones spend their time in compiled loops.
+ *
+ * Iteration counts and compiled loops are shared by all runs, so a loop
+ * that is only hot over many short runs gets compiled too. Running never
+ * allocates, as a run that moves off the tape is abandoned mid-way.
+ */
+struct TieredInterpreter {
+    static const unsigned hot_loop = 1000;
+
+    TieredInterpreter(Program &program, const Options &options)
+        : options(options) {
+        std::vector<unsigned> open;
+        ops.reserve(program.instructions.size());
+        for (auto &insn : program.instructions) {
+            Op op{insn, 0, 0};
+            if (insn.type == Instruction::Type::Loop) {
+                op.loop = loop_count++;
+                open.push_back(ops.size());
+            } else if (insn.type == Instruction::Type::EndLoop) {
+                unsigned begin = open.back();
+                open.pop_back();
+                ops[begin].target = ops.size() + 1;
+                op.loop = ops[begin].loop;
+                op.target = begin;
+            }
+            ops.push_back(op);
+        }
+        loops.reset(new LoopState[loop_count]);
+    }
+
+    int run(char *tape, Runtime *runtime) const {
+        switch (options.cell_bits) {
+        case 16:
+            execute<unsigned short>(tape, runtime);
+            break;
+        case 32:
+            execute<unsigned int>(tape, runtime);
+            break;
+        case 64:
+            execute<unsigned long long>(tape, runtime);
+            break;
+        default:
+            execute<unsigned char>(tape, runtime);
+            break;
+        }
+        return 0;
+    }
+    /**
+     * Bytes of IR plus the machine code of the loops compiled so far
+     */
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t total = ops.size() * sizeof(Op);
+        for (auto &function : functions) {
+            total += function.size();
+        }
+        return total;
+    }
+
+  private:
+    struct Op {
+        Instruction insn;
+        // Loop: index of the op after its EndLoop. EndLoop: index of its
+        // Loop, which checks the condition again.
+        unsigned target;
+        // Loop and EndLoop: which loop they belong to
+        unsigned loop;
+    };
+    struct LoopState {
+        std::atomic<unsigned> iterations{0};
+        // Machine code of the loop once it is compiled
+        std::atomic<FnPointer> code{nullptr};
+    };
+
+    template <typename Cell> void execute(char *tape, Runtime *runtime) const {
+        Cell *head = (Cell *)tape;
+        const Op *op = ops.data();
+        const Op *end = op + ops.size();
+        while (op != end) {
+            const Instruction &insn = op->insn;
+            switch (insn.type) {
+            case Instruction::Type::Add:
+                head[insn.offset] += insn.value;
+                break;
+            case Instruction::Type::Sub:
+                head[insn.offset] -= insn.value;
+                break;
+            case Instruction::Type::Right:
+                head += insn.value;
+                break;
+            case Instruction::Type::Left:
+                head -= insn.value;
+                break;
+            case Instruction::Type::Loop: {
+                if (*head == 0) {
+                    op = &ops[op->target];
+                    continue;
+                }
+                FnPointer code =
+                    loops[op->loop].code.load(std::memory_order_acquire);
+                if (code != nullptr) {
+                    // Compiled loops return the tape pointer they stop at
+                    head = (Cell *)code((char *)head, runtime);
+                    op = &ops[op->target];
+                    continue;
+                }
+                break;
+            }
+            case Instruction::Type::EndLoop:
+                if (loops[op->loop].iterations.fetch_add(
+                        1, std::memory_order_relaxed) == hot_loop) {
+                    promote(op);
+                }
+                op = &ops[op->target];
+                continue;
+            case Instruction::Type::Write:
+                *runtime->out_cursor++ = head[insn.offset];
+                if (runtime->out_cursor >= runtime->out_end) {
+                    runtime->flush(runtime);
+                }
+                break;
+            case Instruction::Type::Read:
+                if (runtime->in_cursor >= runtime->in_end) {
+                    runtime->fill(runtime);
+                }
+                if (runtime->in_cursor < runtime->in_end) {
+                    head[insn.offset] = (unsigned char)*runtime->in_cursor++;
+                } else if (options.eof == EofPolicy::Zero) {
+                    head[insn.offset] = 0;
+                } else if (options.eof == EofPolicy::MinusOne) {
+                    head[insn.offset] = (Cell)-1;
+                }
+                break;
+            case Instruction::Type::Set:
+                head[insn.offset] = (Cell)insn.value;
+                break;
+            case Instruction::Type::MulAdd:
+                if (head[insn.offset] != 0) {
+                    head[insn.target()] +=
+                        (Cell)(insn.mul.factor * head[insn.offset]);
+                }
+                break;
+            case Instruction::Type::Scan:
+                while (*head != 0) {
+                    head += insn.value;
+                }
+                break;
+            }
+            ++op;
+        }
+        runtime->flush(runtime);
+    }
+
+    /**
+     * Compiles the loop that end_loop closes, unless another run already
+     * did or the JIT turned out to be unavailable.
+     */
+    void promote(const Op *end_loop) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (jit_unavailable ||
+            loops[end_loop->loop].code.load(std::memory_order_relaxed)) {
+            return;
+        }
+        const Op *begin = &ops[end_loop->target];
+        Program fragment(end_loop - begin + 1);
+        for (const Op *op = begin; op <= end_loop; op++) {
+            fragment.append(op->insn);
+        }
+        if (fragment.failed()) {
+            // Out of memory: the loop stays interpreted
+            return;
+        }
+        JIT::Function function = JitCompiler(options).compile_loop(fragment);
+        if (!function.valid()) {
+            jit_unavailable = true;
+            return;
+        }
+        loops[end_loop->loop].code.store(function.entry(),
+                                         std::memory_order_release);
+        functions.push_back(std::move(function));
+    }
+
+    Options options;
+    std::vector<Op> ops;
+    unsigned loop_count{0};
+    std::unique_ptr<LoopState[]> loops;
+    mutable std::mutex mutex;
+    mutable std::vector<JIT::Function> functions;
+    mutable bool jit_unavailable{false};
+};
+
+/**
+ * Shared object loaded with dlopen, holding a program built by the system C
+ * compiler. Unloaded when it goes away.
+ */
+struct SharedObject {
+    SharedObject() {}
+    SharedObject(void *handle, FnPointer entry, size_t size)
+        : handle(handle), function(entry), file_size(size) {}
+    SharedObject(const SharedObject &) = delete;
+    SharedObject &operator=(const SharedObject &) = delete;
+    SharedObject(SharedObject &&other) { *this = std::move(other); }
+    SharedObject &operator=(SharedObject &&other) {
+        std::swap(handle, other.handle);
+        std::swap(function, other.function);
+        std::swap(file_size, other.file_size);
+        return *this;
+    }
+    ~SharedObject() {
+        if (handle != nullptr) {
+            dlclose(handle);
+        }
+    }
+
+    bool valid() const { return function != nullptr; }
+    FnPointer entry() const { return function; }
+    size_t size() const { return file_size; }
+
+  private:
+    void *handle{nullptr};
+    FnPointer function{nullptr};
+    size_t file_size{0};
+};
+
+/**
+ * Backend that lowers the optimized IR to C and has the system compiler
+ * build it. Compiling takes far longer than the JIT, but the optimizer of
+ * the C compiler allocates registers across whole loops and vectorizes
+ * them, which pays off for programs that run for a long time. The compiler
+ * is $CC, or cc if that is not set.
+ */
+struct CSourceCompiler {
+    // The C code declares the Runtime fields it uses as struct runtime
+    static_assert(offsetof(Runtime, fill) == 7 * sizeof(void *),
+                  "struct runtime does not match Runtime");
+
+    explicit CSourceCompiler(const Options &options) : options(options) {}
+
+    /**
+     * Returns C source defining
+     * `unsigned long long bf_run(char *tape, struct runtime *runtime)`,
+     * which matches FnPointer.
+     */
+    std::string generate(Program &program) {
+        std::string cell = options.cell_bits == 64   ? "unsigned long long"
+                           : options.cell_bits == 32 ? "unsigned int"
+                           : options.cell_bits == 16 ? "unsigned short"
+                                                     : "unsigned char";
+        std::string eof = options.eof == EofPolicy::Zero       ? "*cell = 0;"
+                          : options.eof == EofPolicy::MinusOne ? "*cell = -1;"
+                                                               : "";
+        source = "typedef " + cell + " cell;\n";
+        source += "struct runtime {\n"
+                  "    char *out_cursor;\n"
+                  "    char *out_end;\n"
+                  "    char *out_buffer;\n"
+                  "    int (*flush)(struct runtime *);\n"
+                  "    char *in_cursor;\n"
+                  "    char *in_end;\n"
+                  "    char *in_buffer;\n"
+                  "    int (*fill)(struct runtime *);\n"
+                  "};\n"
+                  "static inline void put(struct runtime *rt, cell c) {\n"
+                  "    *rt->out_cursor++ = (char)c;\n"
+                  "    if (rt->out_cursor >= rt->out_end)\n"
+                  "        rt->flush(rt);\n"
+                  "}\n"
+                  "static inline void get(struct runtime *rt, cell *cell) {\n"
+                  "    if (rt->in_cursor >= rt->in_end)\n"
+                  "        rt->fill(rt);\n"
+                  "    if (rt->in_cursor < rt->in_end)\n"
+                  "        *cell = (unsigned char)*rt->in_cursor++;\n"
+                  "    else {\n"
+                  "        " + eof + "\n"
+                  "    }\n"
+                  "}\n"
+                  "unsigned long long bf_run(char *tape, "
+                  "struct runtime *rt) {\n"
+                  "    cell *p = (cell *)tape;\n";
+        depth = 1;
+        for (auto &insn : program.instructions) {
+            generate_instruction(insn);
+        }
+        source += "    rt->flush(rt);\n"
+                  "    return 0;\n"
+                  "}\n";
+        return std::move(source);
+    }
+
+    /**
+     * Builds program into a shared object and loads it. Returns an invalid
+     * SharedObject if there is no working C compiler.
+     */
+    SharedObject compile(Program &program) {
+        const char *temp = getenv("TMPDIR");
+        std::string directory = std::string(temp ? temp : "/tmp") +
+                                "/brainfk-XXXXXX";
+        if (mkdtemp(&directory[0]) == nullptr) {
+            return SharedObject();
+        }
+        std::string source_path = directory + "/program.c";
+        std::string library_path = directory + "/program.so";
+        std::string code = generate(program);
+        SharedObject library;
+        int fd = open(source_path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600);
+        if (fd >= 0) {
+            bool written = write_all(fd, code.data(), code.size());
+            close(fd);
+            if (written && run_compiler(source_path, library_path)) {
+                library = load(library_path);
+            }
+        }
+        // The loaded library stays mapped after its file is gone
+        unlink(source_path.c_str());
+        unlink(library_path.c_str());
+        rmdir(directory.c_str());
+        return library;
+    }
+    /**
+     * Writes the C source of program to path without compiling it
+     */
+    bool write(Program &program, const std::string &path,
+               std::string &error) {
+        std::string code = generate(program);
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            error = "Could not create " + path + ": " + strerror(errno);
+            return false;
+        }
+        bool written = write_all(fd, code.data(), code.size());
+        close(fd);
+        if (!written) {
+            error = "Could not write " + path + ": " + strerror(errno);
+            return false;
+        }
+        return true;
+    }
+
+  private:
+    void generate_instruction(Instruction insn) {
+        std::string cell = "p[" + std::to_string(insn.offset) + "]";
+        std::string value = "(cell)" + std::to_string(insn.value) + "LL";
+        switch (insn.type) {
+        case Instruction::Type::Add:
+            if (insn.value == 0) {
+                // Touches the cell, so the read must not be optimized away
+                line("(void)*(volatile cell *)&" + cell + ";");
+                break;
+            }
+            line(cell + " += " + value + ";");
+            break;
+        case Instruction::Type::Sub:
+            line(cell + " -= " + value + ";");
+            break;
+        case Instruction::Type::Right:
+            line("p += " + std::to_string(insn.value) + ";");
+            break;
+        case Instruction::Type::Left:
+            line("p -= " + std::to_string(insn.value) + ";");
+            break;
+        case Instruction::Type::Loop:
+            line("while (*p) {");
+            depth++;
+            break;
+        case Instruction::Type::EndLoop:
+            depth--;
+            line("}");
+            break;
+        case Instruction::Type::Write:
+            line("put(rt, " + cell + ");");
+            break;
+        case Instruction::Type::Read:
+            line("get(rt, &" + cell + ");");
+            break;
+        case Instruction::Type::Set:
+            line(cell + " = " + value + ";");
+            break;
+        case Instruction::Type::MulAdd:
+            // Never touches the target when the loop would not have run
+            line("if (" + cell + ")");
+            line("    p[" + std::to_string(insn.target()) + "] += (cell)(" +
+                 std::to_string(insn.mul.factor) + "LL * " + cell + ");");
+            break;
+        case Instruction::Type::Scan:
+            line("while (*p)");
+            line("    p += " + std::to_string(insn.value) + ";");
+            break;
+        }
+    }
+    void line(const std::string &text) {
+        source.append(4 * depth, ' ');
+        source += text;
+        source += '\n';
+    }
+
+    /**
+     * Runs the C compiler on source and waits for it. Its diagnostics and
+     * anything else it prints go to our stderr, so they never mix with the
+     * output of programs.
+     */
+    static bool run_compiler(const std::string &source,
+                             const std::string &library) {
+        const char *compiler = getenv("CC");
+        if (compiler == nullptr || *compiler == '\0') {
+            compiler = "cc";
+        }
+        const char *arguments[] = {
+            compiler, "-O2",           "-shared", "-fPIC", "-o",
+            library.c_str(), source.c_str(), nullptr,
+        };
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, 2, 1);
+        pid_t pid;
+        int spawned = posix_spawnp(&pid, compiler, &actions, nullptr,
+                                   (char *const *)arguments, environ);
+        posix_spawn_file_actions_destroy(&actions);
+        if (spawned != 0) {
+            return false;
+        }
+        int status;
+        while (waitpid(pid, &status, 0) < 0) {
+            if (errno != EINTR) {
+                return false;
+            }
+        }
+        return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    static SharedObject load(const std::string &path) {
+        void *handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if (handle == nullptr) {
+            return SharedObject();
+        }
+        struct stat info;
+        size_t size = stat(path.c_str(), &info) == 0 ? info.st_size : 0;
+        return SharedObject(handle, (FnPointer)dlsym(handle, "bf_run"), size);
+    }
+
+    Options options;
+    std::string source;
+    int depth{0};
+};
+
+/**
+ * The tape is a large PROT_NONE reservation of which only a prefix is
+ * readable and writable. Touching the rest raises SIGSEGV, and the handler
+ * commits more of the reservation and lets the access restart. The cells
+ * are surrounded by guards that are never committed and are wider than
+ * Instruction::max_reach cells of the widest size, so moving off either
+ * end stops the run instead of corrupting memory, however far the move.
+ * The generated code does no bounds checks at all. All tapes share one
+ * budget of committed memory, and a run that needs more than is left
+ * stops as if it moved past the end. If not even a small reservation can
+ * be made the tape is not valid().
+ */
+struct Tape {
+    static constexpr size_t reservation_size = 1ull << 36;
+    static const size_t initial_size = 1 << 16;
+
+    Tape() {
+        page_size = sysconf(_SC_PAGESIZE);
+        guard_size = ((size_t)Instruction::max_reach * 8 + page_size - 1) /
+                     page_size * page_size;
+        for (usable = std::min<size_t>(reservation_size, commit_budget);
+             usable >= 16 * initial_size; usable /= 2) {
+            void *memory = mmap(0, usable + 2 * guard_size, PROT_NONE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                                -1, 0);
+            if (memory != MAP_FAILED) {
+                base = (char *)memory;
+                break;
+            }
+        }
+        if (base == nullptr) {
+            return;
+        }
+        committed_begin = base + guard_size;
+        committed_end = committed_begin;
+        commit(committed_begin + initial_size);
+        install_handler();
+    }
+    Tape(const Tape &) = delete;
+    Tape &operator=(const Tape &) = delete;
+    ~Tape() {
+        if (base != nullptr) {
+            committed_total -= committed_end - committed_begin;
+            munmap(base, usable + 2 * guard_size);
+        }
+    }
+
+    bool valid() const { return base != nullptr; }
+    /**
+     * Pointer to the first cell, which is page aligned
+     */
+    char *cells() { return committed_begin; }
+    /**
+     * Zeroes the cells used so far. The pages stay committed but are handed
+     * back to the kernel, which refills them with zeros on the next touch.
+     */
+    void clear() {
+        madvise(committed_begin, committed_end - committed_begin,
+                MADV_DONTNEED);
+        status = Status::Ok;
+    }
+    /**
+     * Routes faults on this thread to this tape until leave. A fault that
+     * moves off the tape jumps back to escape, which the caller must have
+     * set with sigsetjmp.
+     */
+    void enter() {
+        outer = active;
+        active = this;
+    }
+    void leave() { active = outer; }
+
+    sigjmp_buf escape;
+    // Why the last run was stopped
+    Status status{Status::Ok};
+
+  private:
+    /**
+     * Makes the tape readable and writable up to end, rounded up to whole
+     * pages. Grows by at least the committed size unless that would exceed
+     * the budget.
+     */
+    bool commit(char *end) {
+        size_t size = committed_end - committed_begin;
+        char *needed = round_up(end);
+        char *wanted = round_up(std::max(end, committed_end + size));
+        if (needed <= committed_end) {
+            return false;
+        }
+        if (!charge(wanted - committed_end)) {
+            wanted = needed;
+            if (!charge(wanted - committed_end)) {
+                return false;
+            }
+        }
+        if (mprotect(committed_end, wanted - committed_end,
+                     PROT_READ | PROT_WRITE) < 0) {
+            committed_total -= wanted - committed_end;
+            return false;
+        }
+        committed_end = wanted;
+        return true;
+    }
+    /**
+     * Rounds end up to a page boundary, but not beyond the usable cells
+     */
+    char *round_up(char *end) {
+        char *limit = committed_begin + usable;
+        size_t rounded =
+            (end - base + page_size - 1) / page_size * page_size;
+        return base + rounded < limit ? base + rounded : limit;
+    }
+    /**
+     * Counts bytes against the budget of all tapes, failing if they do not
+     * fit. Lock-free, so it is safe in the fault handler.
+     */
+    static bool charge(size_t bytes) {
+        if (committed_total.fetch_add(bytes) + bytes > commit_budget) {
+            committed_total -= bytes;
+            return false;
+        }
+        return true;
+    }
+
+    static void install_handler() {
+        // Tapes may be created on several threads at once
+        static std::once_flag installed;
+        std::call_once(installed, [] {
+            struct sigaction action;
+            memset(&action, 0, sizeof(action));
+            action.sa_sigaction = handle_fault;
+            action.sa_flags = SA_SIGINFO;
+            sigemptyset(&action.sa_mask);
+            sigaction(SIGSEGV, &action, &previous_action);
+        });
+    }
+    static void handle_fault(int signal, siginfo_t *info, void *context) {
+        char *address = (char *)info->si_addr;
+        Tape *tape = active;
+        if (tape == nullptr || address < tape->base ||
+            address >= tape->base + tape->usable + 2 * tape->guard_size) {
+            forward_fault(signal, info, context);
+            return;
+        }
+        if (address >= tape->committed_end && tape->commit(address + 1)) {
+            return;
+        }
+        tape->status = address < tape->committed_begin ? Status::MovedLeftOfTape
+                                                       : Status::MovedPastTape;
+        siglongjmp(tape->escape, 1);
+    }
+
+    /**
+     * Hands a fault that is not on a tape to the handler that was installed
+     * before ours, which stays in charge of its own faults. Without one the
+     * fault kills the process as it would have without us.
+     */
+    static void forward_fault(int signal, siginfo_t *info, void *context) {
+        if (previous_action.sa_flags & SA_SIGINFO) {
+            previous_action.sa_sigaction(signal, info, context);
+        } else if (previous_action.sa_handler != SIG_DFL &&
+                   previous_action.sa_handler != SIG_IGN) {
+            previous_action.sa_handler(signal);
+        } else {
+            // The signal stays blocked until we return, then the default
+            // action ends the process
+            struct sigaction action;
+            memset(&action, 0, sizeof(action));
+            action.sa_handler = SIG_DFL;
+            sigemptyset(&action.sa_mask);
+            sigaction(signal, &action, nullptr);
+            raise(signal);
+        }
+    }
+
+    // Faults are delivered to the thread that caused them, so each thread
+    // only needs to know the tape it is running on
+    static inline thread_local Tape *active{nullptr};
+    static inline struct sigaction previous_action;
+    // Committing cells must not be able to exhaust the host, so all tapes
+    // together are capped at half of the physical memory
+    static inline const size_t commit_budget =
+        sysconf(_SC_PHYS_PAGES) / 2 * sysconf(_SC_PAGESIZE);
+    static inline std::atomic<size_t> committed_total{0};
+
+    Tape *outer{nullptr};
+    size_t page_size;
+    size_t guard_size;
+    // Bytes available for cells
+    size_t usable{0};
+    char *base{nullptr};
+    char *committed_begin{nullptr};
+    char *committed_end{nullptr};
+};
+
+Io Io::standard() {
+    Io io;
+    io.write = [](void *, const char *data, size_t size) {
+        while (size > 0) {
+            ssize_t written = ::write(1, data, size);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            data += written;
+            size -= written;
+        }
+        return true;
+    };
+    io.read = [](void *, char *buffer, size_t capacity) {
+        ssize_t count;
+        do {
+            count = ::read(0, buffer, capacity);
+        } while (count < 0 && errno == EINTR);
+        return count < 0 ? (size_t)0 : (size_t)count;
+    };
+    io.context = nullptr;
+    return io;
+}
+
+const char *describe(Status status) {
+    switch (status) {
+    case Status::Ok:
+        return "ok";
+    case Status::MovedLeftOfTape:
+        return "moved left of the first cell";
+    case Status::MovedPastTape:
+        return "moved past the end of the tape";
+    case Status::NoTape:
+        return "could not reserve memory for the tape";
+    }
+    return "unknown status";
+}
+
+/**
+ * Tape, I/O buffers and the Runtime the compiled code sees.
+ */
+struct Context::State {
+    static const size_t output_buffer_size = 1 << 16;
+    static const size_t input_buffer_size = 1 << 16;
+
+    explicit State(Io io) {
+        runtime.out_buffer = output_buffer;
+        runtime.out_end = output_buffer + output_buffer_size;
+        runtime.flush = flush_output;
+        runtime.in_buffer = input_buffer;
+        runtime.fill = fill_input;
+        runtime.io = io;
+    }
+
+    /**
+     * Gets ready for a new run: empty buffers and, if it was used, a zeroed
+     * tape.
+     */
+    void reset() {
+        runtime.out_cursor = runtime.out_buffer;
+        runtime.in_cursor = runtime.in_buffer;
+        runtime.in_end = runtime.in_buffer;
+        if (used) {
+            tape.clear();
+        }
+        used = true;
+    }
+
+    static int flush_output(Runtime *runtime) {
+        size_t size = runtime->out_cursor - runtime->out_buffer;
+        runtime->out_cursor = runtime->out_buffer;
+        if (size == 0 ||
+            runtime->io.write(runtime->io.context, runtime->out_buffer, size)) {
+            return 0;
+        }
+        return -1;
+    }
+    /**
+     * Refills the input buffer, flushing pending output first so prompts
+     * are visible. Returns the number of bytes read, which is 0 at end of
+     * input.
+     */
+    static int fill_input(Runtime *runtime) {
+        flush_output(runtime);
+        size_t count = runtime->io.read(runtime->io.context,
+                                        runtime->in_buffer, input_buffer_size);
+        runtime->in_cursor = runtime->in_buffer;
+        runtime->in_end = runtime->in_buffer + count;
+        return count;
+    }
+
+    Runtime runtime;
+    Tape tape;
+    bool used{false};
+    char output_buffer[output_buffer_size];
+    char input_buffer[input_buffer_size];
+};
+
+Context::Context(Io io) : state(new State(io)) {}
+Context::Context(Context &&other) = default;
+Context &Context::operator=(Context &&other) = default;
+Context::~Context() = default;
+
+bool Context::valid() const { return state->tape.valid(); }
+
+void Context::set_io(Io io) { state->runtime.io = io; }
+
+/**
+ * Parses and optimizes source. Sets error if that fails.
+ */
+Program optimized_program(const char *source, size_t length,
+                          const Options &options, std::string &error) {
+    Program parsed = Compiler().compile_program(source, length, error);
+    if (!error.empty()) {
+        return parsed;
+    }
+    return Optimizer(options).optimize(parsed, error);
+}
+
+/**
+ * Generates code for source to be written out ahead of time. The code may
+ * run on another machine, so it sticks to SSE2. Sets error if that fails.
+ */
+JIT::CodeBuffer generate_portable(const char *source, size_t length,
+                                  const Options &options, std::string &error) {
+    Program program = optimized_program(source, length, options, error);
+    if (!error.empty()) {
+        return JIT::CodeBuffer();
+    }
+    JIT::CodeBuffer code = JitCompiler(options, false).generate(program);
+    if (code.failed()) {
+        error = "Could not generate code for the program";
+    }
+    return code;
+}
+
+/**
+ * The compiled form of a program: machine code when the JIT could install
+ * it, threaded code otherwise.
+ */
+struct CompiledProgram::State {
+    Options options;
+    JIT::Function function;
+    SharedObject library;
+    std::unique_ptr<TieredInterpreter> tiered_interpreter;
+    ThreadedInterpreter threaded_interpreter;
+    std::string error;
+};
+
+CompiledProgram::CompiledProgram() : state(new State()) {}
+CompiledProgram::CompiledProgram(CompiledProgram &&other) = default;
+CompiledProgram &
+CompiledProgram::operator=(CompiledProgram &&other) = default;
+CompiledProgram::~CompiledProgram() = default;
+
+CompiledProgram CompiledProgram::compile(const char *source, size_t length,
+                                         const Options &options) {
+    CompiledProgram compiled;
+    State &state = *compiled.state;
+    state.options = options;
+    std::unique_ptr<CodeCache> cache;
+    if (options.backend == Backend::Jit && !options.cache_directory.empty()) {
+        cache.reset(new CodeCache(options, filter_commands(source, length)));
+        state.function = cache->load();
+        if (state.function.valid()) {
+            return compiled;
+        }
+    }
+    Program program = optimized_program(source, length, options, state.error);
+    if (!state.error.empty()) {
+        return compiled;
+    }
+    /* program.print(); */
+    if (options.backend == Backend::C) {
+        state.library = CSourceCompiler(options).compile(program);
+    }
+    if (options.backend == Backend::Tiered) {
+        state.tiered_interpreter.reset(new TieredInterpreter(program, options));
+        return compiled;
+    }
+    if (options.backend != Backend::Threaded && !state.library.valid()) {
+        state.function = JitCompiler(options).compile(program);
+    }
+    if (cache && state.function.valid()) {
+        cache->store(state.function);
+    }
+    if (!state.function.valid() && !state.library.valid()) {
+        state.threaded_interpreter = ThreadedInterpreter(program, options);
+    }
+    return compiled;
+}
+
+bool compile_executable(const char *source, size_t length,
+                        const Options &options, const std::string &path,
+                        std::string &error) {
+    JIT::CodeBuffer code = generate_portable(source, length, options, error);
+    return error.empty() && ExecutableWriter().write(code, path, error);
+}
+
+bool compile_c_source(const char *source, size_t length,
+                      const Options &options, const std::string &path,
+                      std::string &error) {
+    Program program = optimized_program(source, length, options, error);
+    return error.empty() &&
+           CSourceCompiler(options).write(program, path, error);
+}
+
+bool compile_object(const char *source, size_t length, const Options &options,
+                    const std::string &name, const std::string &path,
+                    std::string &error) {
+    bool identifier = !name.empty();
+    for (char c : name) {
+        identifier = identifier && (isalnum((unsigned char)c) || c == '_');
+    }
+    if (!identifier) {
+        error = "Not a valid symbol name: " + name;
+        return false;
+    }
+    JIT::CodeBuffer code = generate_portable(source, length, options, error);
+    return error.empty() && ObjectWriter().write(code, name, path, error);
+}
+
+bool CompiledProgram::valid() const { return state->error.empty(); }
+
+const std::string &CompiledProgram::error() const { return state->error; }
+
+size_t CompiledProgram::code_size() const {
+    if (state->function.valid()) {
+        return state->function.size();
+    }
+    if (state->library.valid()) {
+        return state->library.size();
+    }
+    if (state->tiered_interpreter) {
+        return state->tiered_interpreter->size();
+    }
+    return state->threaded_interpreter.size();
+}
+
+Status CompiledProgram::run(Context &context) const {
+    Context::State &target = *context.state;
+    Tape &tape = target.tape;
+    if (!tape.valid()) {
+        return Status::NoTape;
+    }
+    target.reset();
+    tape.enter();
+    if (sigsetjmp(tape.escape, 1) == 0) {
+        if (state->function.valid()) {
+            state->function.entry()(tape.cells(), &target.runtime);
+        } else if (state->library.valid()) {
+            state->library.entry()(tape.cells(), &target.runtime);
+        } else if (state->tiered_interpreter) {
+            state->tiered_interpreter->run(tape.cells(), &target.runtime);
+        } else {
+            state->threaded_interpreter.run(tape.cells(), &target.runtime);
+        }
+    }
+    tape.leave();
+    // The run may have been stopped with output still buffered
+    target.runtime.flush(&target.runtime);
+    return tape.status;
+}
+
+/**
+ * Entries are keyed by the program's commands and created by the first
+ * request for a program. They hold a future the compiling request
+ * fulfills; later requests wait on it. Only compiled entries are on the
+ * recency list and can be evicted.
+ */
+struct ProgramCache::State {
+    typedef std::shared_ptr<const CompiledProgram> Result;
+
+    struct Key {
+        std::string commands;
+        EofPolicy eof;
+        Backend backend;
+        int cell_bits;
+
+        bool operator==(const Key &other) const {
+            return commands == other.commands && eof == other.eof &&
+                   backend == other.backend && cell_bits == other.cell_bits;
+        }
+    };
+    struct KeyHash {
+        size_t operator()(const Key &key) const {
+            return std::hash<std::string>()(key.commands) ^
+                   (size_t)key.cell_bits << 4 ^ (size_t)key.eof << 2 ^
+                   (size_t)key.backend;
+        }
+    };
+    struct Entry {
+        std::shared_future<Result> program;
+        std::list<const Key *>::iterator recent;
+        size_t size{0};
+        bool compiled{false};
+    };
+
+    /**
+     * Records a finished compilation and evicts the least recently used
+     * programs until the cache fits its capacity again.
+     */
+    void insert(const Key &key, const Result &program) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = entries.find(key);
+        if (!program->valid()) {
+            entries.erase(found);
+            return;
+        }
+        Entry &entry = found->second;
+        entry.compiled = true;
+        entry.size = program->code_size();
+        recent.push_front(&found->first);
+        entry.recent = recent.begin();
+        used += entry.size;
+        while (used > capacity && !recent.empty()) {
+            auto oldest = entries.find(*recent.back());
+            used -= oldest->second.size;
+            recent.pop_back();
+            entries.erase(oldest);
+        }
+    }
+
+    /**
+     * Forgets a compilation that failed, so the next request tries again
+     */
+    void abandon(const Key &key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.erase(key);
+    }
+
+    std::mutex mutex;
+    std::unordered_map<Key, Entry, KeyHash> entries;
+    // Keys of the compiled entries, most recently used first
+    std::list<const Key *> recent;
+    size_t capacity;
+    size_t used{0};
+};
+
+ProgramCache::ProgramCache(size_t capacity_bytes) : state(new State()) {
+    state->capacity = capacity_bytes;
+}
+
+ProgramCache::~ProgramCache() = default;
+
+std::shared_ptr<const CompiledProgram>
+ProgramCache::get(const char *source, size_t length, const Options &options) {
+    State::Key key{filter_commands(source, length), options.eof,
+                   options.backend, options.cell_bits};
+    std::promise<State::Result> promise;
+    std::shared_future<State::Result> pending;
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        auto found = state->entries.find(key);
+        if (found == state->entries.end()) {
+            state->entries[key].program = promise.get_future().share();
+        } else {
+            State::Entry &entry = found->second;
+            if (entry.compiled) {
+                state->recent.splice(state->recent.begin(), state->recent,
+                                     entry.recent);
+            }
+            pending = entry.program;
+        }
+    }
+    if (pending.valid()) {
+        return pending.get();
+    }
+    std::shared_ptr<const CompiledProgram> program;
+    try {
+        program = std::make_shared<const CompiledProgram>(
+            CompiledProgram::compile(source, length, options));
+    } catch (...) {
+        // Requests waiting for this compilation get the same exception
+        state->abandon(key);
+        promise.set_exception(std::current_exception());
+        throw;
+    }
+    promise.set_value(program);
+    state->insert(key, program);
+    return program;
+}
+
+} // namespace brainfk
@@ -1,668 +1,244 @@
-#include <cstdio>
-#include <fstream>
+#include "brainfk.h"
+
+#include <cerrno>
+#include <fcntl.h>
 #include <iostream>
-#include <memory>
-#include <stack>
-#include <stdlib.h>
-#include <string.h>
 #include <string>
 #include <sys/mman.h>
-#include <vector>
-
-typedef unsigned long long (*FnPointer)(char *);
-
-struct Instruction {
-    enum class Type {
-        Add,
-        Sub,
-        Right,
-        Left,
-        Loop,
-        EndLoop,
-        Write,
-        Read,
-    };
-    Type type;
-    virtual void print() = 0;
-};
-
-struct AddInsn : public Instruction {
-    AddInsn(int val) : value(val) { type = Type::Add; }
-    int value{0};
-    void print() override { std::cerr << "Add(" << value << ")\n"; }
-};
-
-struct SubInsn : public Instruction {
-    SubInsn(int val) : value(val) { type = Type::Sub; }
-    int value{0};
-    void print() override { std::cerr << "Sub(" << value << ")\n"; }
-};
-
-struct RightInsn : public Instruction {
-    RightInsn(int val) : value(val) { type = Type::Right; }
-    int value{0};
-    void print() override { std::cerr << "Right(" << value << ")\n"; }
-};
-
-struct LeftInsn : public Instruction {
-    LeftInsn(int val) : value(val) { type = Type::Left; }
-    int value{0};
-    void print() override { std::cerr << "Left(" << value << ")\n"; }
-};
-
-struct LoopInsn : public Instruction {
-    LoopInsn() { type = Type::Loop; }
-    void print() override { std::cerr << "Loop\n"; }
-};
-
-struct EndLoopInsn : public Instruction {
-    EndLoopInsn() { type = Type::EndLoop; }
-    void print() override { std::cerr << "EndLoop\n"; }
-};
-
-struct WriteInsn : public Instruction {
-    WriteInsn() { type = Type::Write; }
-    void print() override { std::cerr << "Write\n"; }
-};
-
-struct ReadInsn : public Instruction {
-    ReadInsn() { type = Type::Read; }
-    void print() override { std::cerr << "Read\n"; }
-};
-
-struct Block {
-    std::vector<std::unique_ptr<Instruction>> instructions;
-    template <typename T> void append(T &&insn) {
-        instructions.push_back(std::make_unique<T>(insn));
-    }
-    void print() {
-        for (auto &insn : instructions) {
-            insn->print();
-        }
-    }
-};
-
-struct Program {
-    std::vector<std::unique_ptr<Block>> blocks;
-    void append_new_block() { blocks.push_back(std::make_unique<Block>()); }
-    template <typename T> void append_insn(T &&insn) {
-        blocks.back()->append(std::move(insn));
-    }
-    void print() {
-        int idx = 0;
-        for (auto &block : blocks) {
-            std::cerr << "Block " << idx << "\n";
-            block->print();
-            idx++;
-        }
-    }
-};
-
-namespace JIT {
-
-enum class Register8 {
-    AL = 0b000,
-    BL = 0b011,
-    CL = 0b001,
-};
-
-enum class Register32 {
-    EAX = 0b000,
-    EBX = 0b011,
-    ECX = 0b001,
-    EDX = 0b010,
-    ESI = 0b110,
-    EDI = 0b111,
-};
-
-enum class Register64 {
-    RAX = 0b000,
-    RBX = 0b011,
-    RCX = 0b001,
-    RDX = 0b010,
-    RSI = 0b110,
-    RDI = 0b111,
-};
-
-struct Imm8 {
-    static const size_t length = 1;
-    unsigned char value{0};
-    explicit Imm8(unsigned char val) : value(val) {
-        bytes.resize(length);
-        bytes[0] = val;
-    }
-
-    const std::vector<char> &get_bytes() { return bytes; }
-
-  private:
-    std::vector<char> bytes;
-};
-
-struct Imm32 {
-    static const size_t length = 4;
-    unsigned int value{0};
-    explicit Imm32(unsigned int val) : value(val) {
-        bytes.resize(length);
-        for (int i = 0; i < length; i++) {
-            bytes[i] = val & 0xff;
-            val >>= 8;
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Read-only memory mapping of a source file, so the parser can consume it
+ * in place however large it is. Pipes and other files that cannot be
+ * mapped are read into memory instead.
+ */
+struct SourceFile {
+    explicit SourceFile(const std::string &path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "Error: Could not open the file: " << path
+                      << std::endl;
+            exit(1);
         }
-    }
-
-    const std::vector<char> &get_bytes() { return bytes; }
-
-  private:
-    std::vector<char> bytes;
-};
-
-struct Imm64 {
-    static const size_t length = 8;
-    unsigned int value{0};
-    explicit Imm64(unsigned int val) : value(val) {
-        bytes.resize(length);
-        for (int i = 0; i < length; i++) {
-            bytes[i] = val & 0xff;
-            val >>= 8;
+        struct stat info;
+        if (fstat(fd, &info) < 0) {
+            std::cerr << "Error: Could not read the file: " << path
+                      << std::endl;
+            exit(1);
         }
-    }
-
-    const std::vector<char> &get_bytes() { return bytes; }
-
-  private:
-    std::vector<char> bytes;
-};
-
-struct Emitter {
-    void ret() { buffer.emplace_back(0xC3); }
-    void mov(Register32 dst, Imm32 src) {
-        buffer.push_back(0xB8 | (int)dst);
-        auto imm = src.get_bytes();
-        buffer.insert(buffer.end(), imm.begin(), imm.end());
-    }
-    void mov(Register64 dst, Imm64 src) {
-        buffer.push_back(0x48);
-        buffer.push_back(0xB8 | (int)dst);
-        auto imm = src.get_bytes();
-        buffer.insert(buffer.end(), imm.begin(), imm.end());
-    }
-    void mov(Register64 dst, Register64 src) {
-        buffer.push_back(0x48);
-        buffer.push_back(0x89);
-        buffer.push_back(0xc0 | ((int)src) << 3 | (int)dst);
-    }
-    /**
-     * mov dst, [src]
-     */
-    void mov_deref(Register8 dst, Register64 src) {
-        buffer.push_back(0x8A);
-        buffer.push_back(((int)dst) << 3 | (int)src);
-    }
-    /**
-     * mov [dst], src
-     */
-    void deref_mov(Register64 dst, Register8 src) {
-        buffer.push_back(0x88);
-        buffer.push_back(((int)src << 3) | (int)dst);
-    }
-    void add(Register32 dst, Imm32 src) {
-        buffer.push_back(0x81);
-        buffer.push_back(0xC0 | (int)dst);
-        auto imm = src.get_bytes();
-        buffer.insert(buffer.end(), imm.begin(), imm.end());
-    }
-    void add(Register32 dst, Register32 src) {
-        buffer.push_back(0x01);
-        buffer.push_back(0xC0 | ((int)src) << 3 | (int)dst);
-    }
-    void add(Register64 dst, Imm32 src) {
-        buffer.push_back(0x48);
-        buffer.push_back(0x81);
-        buffer.push_back(0xC0 | (int)dst);
-        auto imm = src.get_bytes();
-        buffer.insert(buffer.end(), imm.begin(), imm.end());
-    }
-    void sub(Register32 dst, Imm32 src) {
-        buffer.push_back(0x81);
-        buffer.push_back(0xE8 | (int)dst);
-        auto imm = src.get_bytes();
-        buffer.insert(buffer.end(), imm.begin(), imm.end());
-    }
-    void sub(Register64 dst, Imm32 src) {
-        buffer.push_back(0x48);
-        buffer.push_back(0x81);
-        buffer.push_back(0xE8 | (int)dst);
-        auto imm = src.get_bytes();
-        buffer.insert(buffer.end(), imm.begin(), imm.end());
-    }
-    void al_add(Imm8 src) {
-        buffer.push_back(0x04);
-        auto arg = src.get_bytes();
-        buffer.insert(buffer.end(), arg.begin(), arg.end());
-    }
-    void al_sub(Imm8 src) {
-        buffer.push_back(0x2C);
-        auto arg = src.get_bytes();
-        buffer.insert(buffer.end(), arg.begin(), arg.end());
-    }
-    void cmp(Register32 dst, Imm32 src) {
-        // FIXME: This only compares with EAX
-        buffer.push_back(0x3D);
-        auto arg = src.get_bytes();
-        buffer.insert(buffer.end(), arg.begin(), arg.end());
-    }
-    void cmp_al(Imm8 src) {
-        buffer.push_back(0x3C);
-        auto arg = src.get_bytes();
-        buffer.insert(buffer.end(), arg.begin(), arg.end());
-    }
-    void jmp(Imm32 offset) {
-        buffer.push_back(0xE9);
-        auto arg = offset.get_bytes();
-        buffer.insert(buffer.end(), arg.begin(), arg.end());
-    }
-    void jz(Imm32 offset) {
-        buffer.push_back(0x0F);
-        buffer.push_back(0x84);
-        auto arg = offset.get_bytes();
-        buffer.insert(buffer.end(), arg.begin(), arg.end());
-    }
-    void jnz(Imm32 offset) {
-        buffer.push_back(0x0F);
-        buffer.push_back(0x85);
-        auto arg = offset.get_bytes();
-        buffer.insert(buffer.end(), arg.begin(), arg.end());
-    }
-
-    void syscall() {
-        buffer.push_back(0x0F);
-        buffer.push_back(0x05);
-    }
-
-    std::vector<char> get() { return buffer; }
-    /**
-     * Returns the length of the instructions already emitted
-     */
-    std::size_t length() { return buffer.size(); }
-
-  private:
-    std::vector<char> buffer;
-};
-
-struct Compiler {
-    Compiler() {}
-    void compile_setup(Emitter &emitter) {
-        emitter.mov(Register64::RCX, Register64::RDI);
-    }
-    void compile_cleanup(Emitter &emitter) {
-        emitter.mov(Register64::RAX, Imm64(0));
-        emitter.ret();
-    }
-    void compile_add(AddInsn insn, Emitter &emitter) {
-        emitter.mov_deref(Register8::AL, Register64::RCX);
-        emitter.al_add(Imm8(insn.value));
-        emitter.deref_mov(Register64::RCX, Register8::AL);
-    }
-    void compile_sub(SubInsn insn, Emitter &emitter) {
-        emitter.mov_deref(Register8::AL, Register64::RCX);
-        emitter.al_sub(Imm8(insn.value));
-        emitter.deref_mov(Register64::RCX, Register8::AL);
-    }
-    void compile_right(RightInsn insn, Emitter &emitter) {
-        emitter.add(Register64::RCX, Imm32(insn.value));
-    }
-    void compile_left(LeftInsn insn, Emitter &emitter) {
-        emitter.sub(Register64::RCX, Imm32(insn.value));
-    }
-    void compile_write(WriteInsn insn, Emitter &emitter) {
-        emitter.mov(Register64::RAX, Imm64(1));
-        emitter.mov(Register64::RDI, Imm64(1));
-        emitter.mov(Register64::RSI, Register64::RCX);
-        emitter.mov(Register64::RDX, Imm64(1));
-        emitter.mov(Register64::RBX, Register64::RCX);
-        emitter.syscall();
-        emitter.mov(Register64::RCX, Register64::RBX);
-    }
-    void compile_read(ReadInsn insn, Emitter &emitter) {
-        emitter.mov(Register64::RAX, Imm64(0));
-        emitter.mov(Register64::RDI, Imm64(0));
-        emitter.mov(Register64::RSI, Register64::RCX);
-        emitter.mov(Register64::RDX, Imm64(1));
-        emitter.mov(Register64::RBX, Register64::RCX);
-        emitter.syscall();
-        emitter.mov(Register64::RCX, Register64::RBX);
-    }
-    void compile_loop(int offset, Emitter &emitter) {
-        emitter.mov_deref(Register8::AL, Register64::RCX);
-        emitter.cmp_al(Imm8(0));
-        emitter.jz(Imm32(offset));
-    }
-    void compile_end_loop(int offset, Emitter &emitter) {
-        emitter.mov_deref(Register8::AL, Register64::RCX);
-        emitter.cmp_al(Imm8(0));
-        offset += emitter.length() + 2;
-        emitter.jnz(Imm32(-offset));
-    }
-};
-
-}; // namespace JIT
-
-struct Compiler {
-    Compiler() {}
-
-    Program compile_program(std::string code) {
-        Program program;
-        program.append_new_block();
-        for (int i = 0; i < code.length(); i++) {
-            if (is_add_or_sub(code, i)) {
-                int total = 0;
-                while (is_add_or_sub(code, i)) {
-                    if (code[i] == '+') {
-                        total++;
-                    } else {
-                        total--;
-                    }
-                    i++;
-                }
-
-                // This is necessary to keep the increment in the for loop valid
-                i--;
-
-                if (total == 0) {
-                    continue;
-                }
-                if (total > 0) {
-                    program.append_insn(AddInsn(total));
-                } else {
-                    program.append_insn(SubInsn(-total));
-                }
-                continue;
-            }
-            if (is_shift(code, i)) {
-                int total = 0;
-                while (is_shift(code, i)) {
-                    if (code[i] == '<') {
-                        total--;
-                    } else {
-                        total++;
-                    }
-                    i++;
-                }
-
-                // This is necessary to keep the increment in the for loop valid
-                i--;
-
-                if (total == 0) {
-                    continue;
-                }
-                if (total > 0) {
-                    program.append_insn(RightInsn(total));
-                } else {
-                    program.append_insn(LeftInsn(-total));
-                }
-                continue;
-            }
-            if (code[i] == '.') {
-                program.append_insn(WriteInsn());
-                continue;
-            }
-            if (code[i] == ',') {
-                program.append_insn(ReadInsn());
-                continue;
-            }
-            if (code[i] == '[') {
-                program.append_new_block();
-                program.append_insn(LoopInsn());
-                program.append_new_block();
-                continue;
-            }
-            if (code[i] == ']') {
-                program.append_new_block();
-                program.append_insn(EndLoopInsn());
-                program.append_new_block();
-                continue;
+        if (!S_ISREG(info.st_mode)) {
+            read_stream(fd, path);
+            close(fd);
+            return;
+        }
+        length = info.st_size;
+        if (length > 0) {
+            void *mapped = mmap(0, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED) {
+                std::cerr << "Error: Could not map the file: " << path
+                          << std::endl;
+                exit(1);
             }
+            madvise(mapped, length, MADV_SEQUENTIAL);
+            contents = (const char *)mapped;
+            this->mapped = true;
         }
-        validate_loops(program);
-        return program;
+        close(fd);
     }
-
-  private:
-    void validate_loops(Program &program) {
-        int loop_depth = 0;
-        for (auto &block : program.blocks) {
-            for (auto &insn : block->instructions) {
-                if (insn->type == Instruction::Type::Loop) {
-                    loop_depth++;
-                } else if (insn->type == Instruction::Type::EndLoop) {
-                    loop_depth--;
-                    if (loop_depth < 0) {
-                        std::cerr << "Invalid input program: Unmatched ']'\n";
-                        exit(1);
-                    }
-                }
-            }
+    SourceFile(const SourceFile &) = delete;
+    SourceFile &operator=(const SourceFile &) = delete;
+    ~SourceFile() {
+        if (mapped) {
+            munmap((void *)contents, length);
         }
-        if (loop_depth > 0) {
-            std::cerr << "Invalid input program: Unmatched '['\n";
-            exit(1);
-        }
-    }
-    bool is_add_or_sub(std::string &code, int pos) {
-        return pos < code.length() && (code[pos] == '-' || code[pos] == '+');
     }
-    bool is_shift(std::string &code, int pos) {
-        return pos < code.length() && (code[pos] == '<' || code[pos] == '>');
-    }
-};
 
-struct JitCompiler {
-
-    JitCompiler() {}
-
-    FnPointer compile(Program &program) {
-        setup();
-        generate_emitters(program);
-        emit_jumps(program);
-        cleanup();
-        std::vector<char> fn_code;
-        for (auto &emitter : emitters) {
-            std::vector<char> data = emitter.get();
-            fn_code.insert(fn_code.end(), data.begin(), data.end());
-        }
-
-        void *fn_memory = allocate_function(fn_code.size() + 1);
-        memcpy(fn_memory, fn_code.data(), fn_code.size());
-        return (FnPointer)fn_memory;
-    }
+    const char *data() { return contents; }
+    size_t size() { return length; }
 
   private:
-    void generate_emitters(Program &program) {
-        for (auto &block : program.blocks) {
-            emitters.push_back(JIT::Emitter());
-            for (auto &insn : block->instructions) {
-                process_instruction(insn.get());
-            }
-        }
-    }
-
-    void emit_jumps(Program &program) {
-        for (int i = 0; i < program.blocks.size(); i++) {
-            if (program.blocks[i]->instructions.empty()) {
+    void read_stream(int fd, const std::string &path) {
+        char chunk[1 << 16];
+        for (;;) {
+            ssize_t count = read(fd, chunk, sizeof(chunk));
+            if (count < 0 && errno == EINTR) {
                 continue;
             }
-            auto &insn = program.blocks[i]->instructions.front();
-            if (insn->type == Instruction::Type::Loop) {
-                i = emit_jumps(program, i);
+            if (count < 0) {
+                std::cerr << "Error: Could not read the file: " << path
+                          << std::endl;
+                exit(1);
             }
-        }
-    }
-    int emit_jumps(Program &program, int position) {
-        int length = 0;
-        for (int i = position + 1; i < program.blocks.size(); i++) {
-            if (program.blocks[i]->instructions.empty()) {
-                continue;
-            }
-            auto &insn = program.blocks[i]->instructions.front();
-            if (insn->type == Instruction::Type::Loop) {
-                int destination = emit_jumps(program, i);
-                for (int j = i; j <= destination; j++) {
-                    length += emitters[j + 1].length();
-                }
-                i = destination;
-            } else if (insn->type == Instruction::Type::EndLoop) {
-                insn_compiler.compile_loop(length, emitters[position + 1]);
-                length += emitters[position + 1].length();
-                insn_compiler.compile_end_loop(length, emitters[i + 1]);
-                return i;
-            } else {
-                length += emitters[i + 1].length();
+            if (count == 0) {
+                break;
             }
+            buffer.append(chunk, count);
         }
-        std::cerr << "I don't know what to do here\n";
-        exit(0);
+        contents = buffer.data();
+        length = buffer.size();
     }
 
-    void *allocate_function(std::size_t size) {
-        void *fn_memory = mmap(0, size, PROT_READ | PROT_WRITE | PROT_EXEC,
-                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        return fn_memory;
-    }
-    void setup() {
-        JIT::Emitter emitter;
-        insn_compiler.compile_setup(emitter);
-        emitters.push_back(emitter);
-    }
-    void cleanup() {
-        JIT::Emitter emitter;
-        insn_compiler.compile_cleanup(emitter);
-        emitters.push_back(emitter);
-    }
-    void process_instruction(Instruction *insn) {
-        switch (insn->type) {
-        case Instruction::Type::Add: {
-            insn_compiler.compile_add(*static_cast<AddInsn *>(insn),
-                                      emitters.back());
-            break;
-        }
-        case Instruction::Type::Sub: {
-            insn_compiler.compile_sub(*static_cast<SubInsn *>(insn),
-                                      emitters.back());
-            break;
-        }
-        case Instruction::Type::Right: {
-            insn_compiler.compile_right(*static_cast<RightInsn *>(insn),
-                                        emitters.back());
-            break;
-        }
-        case Instruction::Type::Left: {
-            insn_compiler.compile_left(*static_cast<LeftInsn *>(insn),
-                                       emitters.back());
-            break;
-        }
-        case Instruction::Type::Read: {
-            insn_compiler.compile_read(*static_cast<ReadInsn *>(insn),
-                                       emitters.back());
-            break;
-        }
-        case Instruction::Type::Write: {
-            insn_compiler.compile_write(*static_cast<WriteInsn *>(insn),
-                                        emitters.back());
-            break;
-        }
-        case Instruction::Type::Loop: {
-            break;
-        }
-        case Instruction::Type::EndLoop: {
-            break;
-        }
-        }
-    }
-    std::vector<JIT::Emitter> emitters;
-    JIT::Compiler insn_compiler;
-};
-
-struct Interpreter {
-    int run_program(std::string &&code) {
-        this->code = code;
-        Program program = compiler.compile_program(code);
-        /* program.print(); */
-        FnPointer fn = jit_compiler.compile(program);
-        vm_buffer = new char[50000];
-        memset(vm_buffer, 0, sizeof(char[50000]));
-        int result = fn(vm_buffer);
-        delete vm_buffer;
-        return result;
-    }
-
-  private:
-    char *vm_buffer;
-    std::string code;
-    JitCompiler jit_compiler;
-    Compiler compiler;
+    const char *contents{nullptr};
+    size_t length{0};
+    bool mapped{false};
+    // Contents of files that were read rather than mapped
+    std::string buffer;
 };
 
-std::string read_file(const std::string &filePath) {
-    std::ifstream file(filePath); // Open the file stream
-
-    if (!file.is_open()) {
-        std::cerr << "Error: Could not open the file: " << filePath
-                  << std::endl;
-        return ""; // Return an empty string to indicate failure
+bool parse_eof_policy(const std::string &value, brainfk::EofPolicy &policy) {
+    if (value == "unchanged") {
+        policy = brainfk::EofPolicy::Unchanged;
+    } else if (value == "zero") {
+        policy = brainfk::EofPolicy::Zero;
+    } else if (value == "minus-one") {
+        policy = brainfk::EofPolicy::MinusOne;
+    } else {
+        return false;
     }
+    return true;
+}
 
-    std::string content; // String to hold the file content
-    std::string line;    // String to read each line from the file
+bool parse_backend(const std::string &value, brainfk::Backend &backend) {
+    if (value == "jit") {
+        backend = brainfk::Backend::Jit;
+    } else if (value == "threaded") {
+        backend = brainfk::Backend::Threaded;
+    } else if (value == "c") {
+        backend = brainfk::Backend::C;
+    } else if (value == "tiered") {
+        backend = brainfk::Backend::Tiered;
+    } else {
+        return false;
+    }
+    return true;
+}
 
-    // Read the file line by line and append it to the content string
-    while (std::getline(file, line)) {
-        content += line + "\n";
+bool parse_cell_bits(const std::string &value, int &bits) {
+    if (value != "8" && value != "16" && value != "32" && value != "64") {
+        return false;
     }
-
-    file.close(); // Close the file stream
-
-    return content;
+    bits = std::stoi(value);
+    return true;
 }
 
-std::string process_input(std::string &input) {
-    std::string result;
-    for (char c : input) {
-        if (c == '+') {
-            result += c;
-        }
-        if (c == '-') {
-            result += c;
-        }
-        if (c == '>') {
-            result += c;
-        }
-        if (c == '<') {
-            result += c;
-        }
-        if (c == '[') {
-            result += c;
-        }
-        if (c == ']') {
-            result += c;
-        }
-        if (c == '.') {
-            result += c;
-        }
-        if (c == ',') {
-            result += c;
-        }
-    }
-    return result;
+void print_usage(const char *program) {
+    std::cout << "Usage: " << program << " [options] <filename>\n"
+              << "Options:\n"
+              << "  --eof=unchanged|zero|minus-one  "
+                 "value stored by ',' at end of input\n"
+              << "  --cell-bits=8|16|32|64          "
+                 "size of a tape cell (default: 8)\n"
+              << "  --backend=jit|threaded|c|tiered "
+                 "how the program is run (default: jit)\n"
+              << "  --cache-dir=<directory>         "
+                 "reuse compiled code across runs\n"
+              << "  --emit-elf <file>               "
+                 "write a standalone executable instead of running\n"
+              << "  --emit-object <file>            "
+                 "write a linkable object defining bf_<name>\n"
+              << "  --name=<name>                   "
+                 "name for --emit-object (default: file name)\n"
+              << "  --emit-c <file>                 "
+                 "write the C code of the c backend instead of running\n";
 }
 
 int main(int argc, const char *argv[]) {
-    if (argc < 2) {
-        std::cout << "Usage: " << argv[0] << " <filename>\n";
+    brainfk::Options options;
+    std::string filename;
+    std::string executable;
+    std::string object;
+    std::string name;
+    std::string c_source;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--eof=", 0) == 0) {
+            if (!parse_eof_policy(arg.substr(6), options.eof)) {
+                std::cerr << "Unknown EOF policy: " << arg.substr(6) << "\n";
+                return 1;
+            }
+        } else if (arg.rfind("--cell-bits=", 0) == 0) {
+            if (!parse_cell_bits(arg.substr(12), options.cell_bits)) {
+                std::cerr << "Unsupported cell size: " << arg.substr(12)
+                          << "\n";
+                return 1;
+            }
+        } else if (arg.rfind("--backend=", 0) == 0) {
+            if (!parse_backend(arg.substr(10), options.backend)) {
+                std::cerr << "Unknown backend: " << arg.substr(10) << "\n";
+                return 1;
+            }
+        } else if (arg.rfind("--cache-dir=", 0) == 0) {
+            options.cache_directory = arg.substr(12);
+        } else if (arg.rfind("--emit-elf=", 0) == 0) {
+            executable = arg.substr(11);
+        } else if (arg == "--emit-elf" && i + 1 < argc) {
+            executable = argv[++i];
+        } else if (arg.rfind("--emit-object=", 0) == 0) {
+            object = arg.substr(14);
+        } else if (arg == "--emit-object" && i + 1 < argc) {
+            object = argv[++i];
+        } else if (arg.rfind("--emit-c=", 0) == 0) {
+            c_source = arg.substr(9);
+        } else if (arg == "--emit-c" && i + 1 < argc) {
+            c_source = argv[++i];
+        } else if (arg.rfind("--name=", 0) == 0) {
+            name = arg.substr(7);
+        } else if (arg.rfind("--", 0) == 0) {
+            std::cerr << "Unknown option: " << arg << "\n";
+            print_usage(argv[0]);
+            return 1;
+        } else {
+            filename = arg;
+        }
+    }
+    if (filename.empty()) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    SourceFile source(filename);
+    if (!executable.empty()) {
+        std::string error;
+        if (!brainfk::compile_executable(source.data(), source.size(), options,
+                                         executable, error)) {
+            std::cerr << error << "\n";
+            return 1;
+        }
+        return 0;
+    }
+    if (!object.empty()) {
+        if (name.empty()) {
+            name = object.substr(object.find_last_of('/') + 1);
+            name = name.substr(0, name.find('.'));
+        }
+        std::string error;
+        if (!brainfk::compile_object(source.data(), source.size(), options,
+                                     name, object, error)) {
+            std::cerr << error << "\n";
+            return 1;
+        }
+        return 0;
+    }
+    if (!c_source.empty()) {
+        std::string error;
+        if (!brainfk::compile_c_source(source.data(), source.size(), options,
+                                       c_source, error)) {
+            std::cerr << error << "\n";
+            return 1;
+        }
+        return 0;
+    }
+    auto program = brainfk::CompiledProgram::compile(source.data(),
+                                                     source.size(), options);
+    if (!program.valid()) {
+        std::cerr << program.error() << "\n";
+        return 1;
+    }
+    brainfk::Context context;
+    brainfk::Status status = program.run(context);
+    if (status != brainfk::Status::Ok) {
+        std::cerr << "Tape error: " << brainfk::describe(status) << "\n";
         return 1;
     }
-    std::string filename = argv[1];
-    std::string input = read_file(filename);
-    input = process_input(input);
-    Interpreter interpreter;
-    interpreter.run_program(input.c_str());
     return 0;
 }